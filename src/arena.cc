@@ -0,0 +1,205 @@
+// arena.cc
+// This file contains the table allocator declared in arena.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+// the size of a huge page, and the smallest table worth putting on them
+
+#define HUGE_PAGE	(2ULL<<20)
+#define HUGE_MIN	(HUGE_PAGE/2)
+
+// a live table
+
+struct arena_table {
+	void *p;			// the mapping
+	unsigned long long int mapped;
+	bool huge;
+	int owner;			// in owners, or -1 when not reporting
+};
+
+// the totals for the tables of one name, kept only with ARENA_REPORT.
+// freed tables count with what was resident when they were freed
+
+struct arena_owner {
+	const char *name;
+	int count, huge;
+	unsigned long long int size, mapped, resident;
+};
+
+static arena_table *tables;		// the live tables, in no order
+static int ntables, maxtables;
+static arena_owner *owners;
+static int nowners, maxowners;
+static int arena_flags;
+static unsigned long long int arena_limit, arena_used;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// make room for one more element in an array of n of max
+
+static void *grow (void *a, int n, int *max, unsigned long long int size) {
+	if (n < *max) return a;
+	*max = *max ? 2 * *max : 64;
+	a = realloc (a, *max * size);
+	if (!a) {
+		perror ("arena_alloc");
+		exit (1);
+	}
+	return a;
+}
+
+// the totals for name, which are usually found by the pointer alone
+
+static int find_owner (const char *name) {
+	for (int i=0; i<nowners; i++)
+		if (owners[i].name == name || strcmp (owners[i].name, name) == 0) return i;
+	owners = (arena_owner *) grow (owners, nowners, &maxowners, sizeof (arena_owner));
+	arena_owner *o = &owners[nowners];
+	memset (o, 0, sizeof (*o));
+	o->name = name;
+	return nowners++;
+}
+
+// set the flags for tables allocated from now on and the most bytes that
+// may be mapped at once; 0 means no limit
+
+void init_arena (int flags, unsigned long long int limit) {
+	arena_flags = flags;
+	arena_limit = limit;
+}
+
+static unsigned long long int round_up (unsigned long long int x, unsigned long long int to) {
+	return (x + to - 1) / to * to;
+}
+
+// map size bytes for t, on huge pages if that was asked for and is worth it
+
+static void map_table (arena_table *t, unsigned long long int size) {
+	unsigned long long int page = sysconf (_SC_PAGESIZE);
+	void *p;
+
+	t->huge = false;
+	if ((arena_flags & ARENA_HUGE_PAGES) && size >= HUGE_MIN) {
+		// reserved huge pages first
+
+		t->mapped = round_up (size, HUGE_PAGE);
+		p = mmap (NULL, t->mapped, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			t->p = p;
+			t->huge = true;
+			return;
+		}
+
+		// otherwise ordinary pages the kernel may merge into huge ones.
+		// map an extra huge page so the table can start on a boundary,
+		// then unmap what is left over on either side
+
+		p = mmap (NULL, t->mapped + HUGE_PAGE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED) {
+			char *start = (char *) round_up ((unsigned long long int) p, HUGE_PAGE);
+			char *end = (char *) p + t->mapped + HUGE_PAGE;
+			if (start > (char *) p) munmap (p, start - (char *) p);
+			if (end > start + t->mapped) munmap (start + t->mapped, end - (start + t->mapped));
+			t->p = start;
+			t->huge = madvise (start, t->mapped, MADV_HUGEPAGE) == 0;
+			return;
+		}
+	}
+	t->mapped = round_up (size, page);
+	p = mmap (NULL, t->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror ("arena_alloc");
+		exit (1);
+	}
+	t->p = p;
+}
+
+// return how many bytes of t are in memory
+
+static unsigned long long int resident_bytes (arena_table *t) {
+	unsigned long long int page = sysconf (_SC_PAGESIZE);
+	unsigned long long int n = round_up (t->mapped, page) / page, count = 0;
+	unsigned char *v = (unsigned char *) malloc (n);
+
+	if (!v || mincore (t->p, t->mapped, v)) {
+		free (v);
+		return 0;
+	}
+	for (unsigned long long int i=0; i<n; i++) count += v[i] & 1;
+	free (v);
+	return count * page;
+}
+
+// allocate a zeroed table of size bytes for the named owner.  the pages
+// aren't touched here; the caller's first write puts them on its node
+
+void *arena_alloc (unsigned long long int size, const char *name) {
+	arena_table t;
+
+	map_table (&t, size);
+	pthread_mutex_lock (&arena_lock);
+	arena_used += t.mapped;
+	if (arena_limit && arena_used > arena_limit) {
+		fprintf (stderr, "arena_alloc: %s needs %llu bytes, over the limit of %llu\n",
+			name, t.mapped, arena_limit);
+		exit (1);
+	}
+	t.owner = -1;
+	if (arena_flags & ARENA_REPORT) {
+		t.owner = find_owner (name);
+		arena_owner *o = &owners[t.owner];
+		o->count++;
+		o->huge += t.huge;
+		o->size += size;
+		o->mapped += t.mapped;
+	}
+	tables = (arena_table *) grow (tables, ntables, &maxtables, sizeof (arena_table));
+	tables[ntables++] = t;
+	pthread_mutex_unlock (&arena_lock);
+	return t.p;
+}
+
+// give back a table from arena_alloc, remembering how much of it was used
+// if that is being reported.  only live tables are kept, so this costs no
+// more for a program that makes and frees predictors over and over
+
+void arena_free (void *p) {
+	if (!p) return;
+	pthread_mutex_lock (&arena_lock);
+	for (int i=0; i<ntables; i++) {
+		arena_table *t = &tables[i];
+		if (t->p == p) {
+			if (t->owner >= 0) owners[t->owner].resident += resident_bytes (t);
+			munmap (t->p, t->mapped);
+			arena_used -= t->mapped;
+			tables[i] = tables[--ntables];
+			break;
+		}
+	}
+	pthread_mutex_unlock (&arena_lock);
+}
+
+// print the tables by owner: how many there were, and their total size,
+// mapped and resident bytes.  this needs ARENA_REPORT
+
+void print_arena (FILE *f) {
+	pthread_mutex_lock (&arena_lock);
+	fprintf (f, "%-20s %6s %14s %14s %14s %s\n", "table", "count", "bytes", "mapped", "resident", "huge pages");
+	for (int i=0; i<nowners; i++) {
+		arena_owner *o = &owners[i];
+		unsigned long long int resident = o->resident;
+		for (int j=0; j<ntables; j++)
+			if (tables[j].owner == i) resident += resident_bytes (&tables[j]);
+		fprintf (f, "%-20s %6d %14llu %14llu %14llu %s\n", o->name, o->count,
+			o->size, o->mapped, resident, o->huge == o->count ? "yes" : o->huge ? "some" : "no");
+	}
+	pthread_mutex_unlock (&arena_lock);
+}
@@ -0,0 +1,19 @@
+// arena.h
+// This file declares the allocator for the big tables of the predictors and
+// the trace decoder.  Each table gets its own page-aligned anonymous mapping,
+// so it is 64-byte aligned, never shares a page with another table, and is
+// placed on the NUMA node of the thread that first touches it (the thread
+// that constructs the predictor clears its tables, so each chunk of a
+// chunked replay gets memory local to its thread).  The arena can back the
+// tables with huge pages, can refuse to grow past a limit, and reports how
+// much of each table is actually resident.
+
+// flags for init_arena
+
+#define ARENA_HUGE_PAGES	1	// MAP_HUGETLB, else transparent huge pages
+#define ARENA_REPORT		2	// keep totals by owner for print_arena
+
+void init_arena (int, unsigned long long int);
+void *arena_alloc (unsigned long long int, const char *);
+void arena_free (void *);
+void print_arena (FILE *);
@@ -0,0 +1,336 @@
+// bunzip.cc
+// This file contains the parallel bzip2 decompressor declared in bunzip.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <bzlib.h>
+
+#include "bunzip.h"
+
+// the 48-bit magic numbers that start a block and end a stream
+
+#define BLOCK_MAGIC	0x314159265359ULL
+#define END_MAGIC	0x177245385090ULL
+
+// how many boundaries past its own a block is retried up to, in case the
+// ones in between were block magic turning up inside compressed data
+
+#define MAX_EXTEND	4
+
+// how many blocks may be decompressed ahead of the one being written,
+// per thread
+
+#define WINDOW		2
+
+// size of the pipe to the trace reader
+
+#define PIPE_SIZE	(1<<20)
+
+// a boundary found in the compressed data, and the job of decompressing
+// the block that starts there
+
+struct bz_block {
+	unsigned long long int bit;	// where its magic starts
+	bool is_block;			// block magic rather than end of stream
+	bool done, ok;
+	int end;			// boundary where the block turned out to end
+	char *out;			// the decompressed bytes
+	unsigned long long int len;
+};
+
+static unsigned char *input;		// the whole compressed file
+static unsigned long long int input_len;
+static bz_block *blocks;
+static int nblocks;
+static int next_job;			// next block for a worker to take
+static int writing;			// block the writer is waiting for
+static int nthreads;
+static bool stopping;			// the reader has gone away
+static bool failed;			// a block didn't decompress
+static int outfd = -1;
+static pthread_t writer, *workers;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+// which of the 8 bit offsets of a magic number could put each byte value
+// in the third byte of the window the scan looks at
+
+static unsigned char candidates[256];
+
+// the 48 bits of data starting at bit b
+
+static unsigned long long int bits_at (unsigned long long int b) {
+	unsigned long long int p = b / 8, w = 0;
+	for (int i=0; i<7; i++)
+		w = (w << 8) | (p + i < input_len ? input[p + i] : 0);
+	return (w >> (8 - b % 8)) & 0xffffffffffffULL;
+}
+
+// find the block and end-of-stream magic numbers in the input.  a magic
+// starting at bit s of byte p fully covers byte p+2, so only the offsets
+// that byte allows are checked
+
+static void scan_blocks (void) {
+	for (int s=0; s<8; s++) {
+		candidates[(BLOCK_MAGIC >> (24 + s)) & 0xff] |= 1 << s;
+		candidates[(END_MAGIC >> (24 + s)) & 0xff] |= 1 << s;
+	}
+	int max = 64;
+	blocks = (bz_block *) malloc (max * sizeof (bz_block));
+	nblocks = 0;
+	for (unsigned long long int p=0; p+6<input_len; p++) {
+		int c = candidates[input[p+2]];
+		for (int s=0; c; s++, c>>=1) {
+			if (!(c & 1)) continue;
+			unsigned long long int b = p * 8 + s, m = bits_at (b);
+			if (m != BLOCK_MAGIC && m != END_MAGIC) continue;
+			if (nblocks == max) {
+				max *= 2;
+				blocks = (bz_block *) realloc (blocks, max * sizeof (bz_block));
+			}
+			bz_block *k = &blocks[nblocks++];
+			memset (k, 0, sizeof (bz_block));
+			k->bit = b;
+			k->is_block = m == BLOCK_MAGIC;
+		}
+	}
+}
+
+// appends bits to a byte buffer
+
+struct bit_writer {
+	unsigned char *p;
+	unsigned long long int n;	// bits written
+	void put (unsigned long long int v, int bits) {
+		while (bits--) {
+			if (!(n & 7)) p[n / 8] = 0;
+			p[n / 8] |= ((v >> bits) & 1) << (7 - (n & 7));
+			n++;
+		}
+	}
+};
+
+// decompress the bits [from, to) of the input, a block from its magic on,
+// by wrapping them in a stream of their own.  the stream's combined CRC
+// for one block is the block's CRC, the 32 bits after its magic
+
+static bool decompress_block (unsigned long long int from, unsigned long long int to, char **out, unsigned long long int *len) {
+	unsigned long long int nbits = to - from;
+	unsigned char *s = (unsigned char *) malloc (4 + nbits / 8 + 16);
+	memcpy (s, "BZh9", 4);
+
+	// copy the block a byte at a time, shifted to a byte boundary
+
+	unsigned long long int p = from / 8, nbytes = nbits / 8;
+	int r = from % 8;
+	for (unsigned long long int i=0; i<nbytes; i++) {
+		unsigned int hi = input[p + i], lo = p + i + 1 < input_len ? input[p + i + 1] : 0;
+		s[4 + i] = (hi << r | lo >> (8 - r)) & 0xff;
+	}
+	bit_writer w = { s + 4, nbytes * 8 };
+	for (unsigned long long int b = from + nbytes * 8; b < to; b++)
+		w.put (input[b / 8] >> (7 - b % 8), 1);
+	unsigned long long int crc = (bits_at (from + 48) >> 16) & 0xffffffff;
+	w.put (END_MAGIC, 48);
+	w.put (crc, 32);
+
+	bz_stream z;
+	memset (&z, 0, sizeof (z));
+	if (BZ2_bzDecompressInit (&z, 0, 0) != BZ_OK) {
+		free (s);
+		return false;
+	}
+	unsigned long long int size = 1<<20, n = 0;
+	char *o = (char *) malloc (size);
+	z.next_in = (char *) s;
+	z.avail_in = 4 + (w.n + 7) / 8;
+	int e;
+	do {
+		if (n == size) {
+			size *= 2;
+			o = (char *) realloc (o, size);
+		}
+		z.next_out = o + n;
+		z.avail_out = size - n;
+		e = BZ2_bzDecompress (&z);
+		n = size - z.avail_out;
+	} while (e == BZ_OK && (z.avail_in || !z.avail_out));
+	BZ2_bzDecompressEnd (&z);
+	free (s);
+	if (e != BZ_STREAM_END) {
+		free (o);
+		return false;
+	}
+	*out = o;
+	*len = n;
+	return true;
+}
+
+// take blocks in order and decompress them, staying at most WINDOW per
+// thread ahead of the writer
+
+static void *work (void *) {
+	for (;;) {
+		pthread_mutex_lock (&lock);
+		while (!stopping && next_job < nblocks && next_job >= writing + WINDOW * nthreads)
+			pthread_cond_wait (&changed, &lock);
+		if (stopping || next_job >= nblocks) {
+			pthread_mutex_unlock (&lock);
+			return NULL;
+		}
+		int i = next_job++;
+		pthread_mutex_unlock (&lock);
+
+		bz_block *k = &blocks[i];
+		bool ok = false;
+		int end = i + 1;
+		if (k->is_block)
+			for (; !ok && end < nblocks && end <= i + 1 + MAX_EXTEND; end++)
+				ok = decompress_block (k->bit, blocks[end].bit, &k->out, &k->len);
+
+		pthread_mutex_lock (&lock);
+		k->done = true;
+		k->ok = ok;
+		k->end = end - ok;
+		pthread_cond_broadcast (&changed);
+		pthread_mutex_unlock (&lock);
+	}
+}
+
+// write all of buf to the reader; false if it has gone away
+
+static bool write_all (const char *buf, unsigned long long int n) {
+	while (n) {
+		ssize_t w = write (outfd, buf, n < (1<<20) ? n : (1<<20));
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return false;
+		buf += w;
+		n -= w;
+	}
+	return true;
+}
+
+// write the blocks out in order, following each one to the boundary it
+// ended at.  closing the pipe gives the reader end of file, after a block
+// that doesn't decompress too; bunzip_failed then tells it apart from the
+// real end
+
+static void *write_blocks (void *) {
+	// the reader may stop early, which should end this thread, not the
+	// program, so writing to the closed pipe gets EPIPE instead of SIGPIPE
+
+	sigset_t set;
+	sigemptyset (&set);
+	sigaddset (&set, SIGPIPE);
+	pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+	int i = 0;
+	while (i < nblocks) {
+		bz_block *k = &blocks[i];
+		if (!k->is_block) {
+			i++;
+			continue;
+		}
+		pthread_mutex_lock (&lock);
+		writing = i;
+		pthread_cond_broadcast (&changed);
+		while (!k->done) pthread_cond_wait (&changed, &lock);
+		pthread_mutex_unlock (&lock);
+		if (!k->ok) {
+			fprintf (stderr, "bunzip: bad bzip2 block at bit %llu\n", k->bit);
+			pthread_mutex_lock (&lock);
+			failed = true;
+			pthread_mutex_unlock (&lock);
+			break;
+		}
+		bool more = write_all (k->out, k->len);
+		free (k->out);
+		k->out = NULL;
+		if (!more) break;
+		i = k->end;
+	}
+
+	// let the workers go
+
+	pthread_mutex_lock (&lock);
+	stopping = true;
+	pthread_cond_broadcast (&changed);
+	pthread_mutex_unlock (&lock);
+	close (outfd);
+	outfd = -1;
+	return NULL;
+}
+
+// start decompressing the bzip2 data in fd, whose first n bytes have
+// already been read into head, on threads threads.  return the file
+// descriptor to read the decompressed data from
+
+int start_bunzip (int fd, const unsigned char *head, unsigned int n, int threads) {
+	// read the whole input
+
+	unsigned long long int size = n > (1<<20) ? n : (1<<20);
+	input = (unsigned char *) malloc (size);
+	memcpy (input, head, n);
+	input_len = n;
+	for (;;) {
+		if (input_len == size) {
+			size *= 2;
+			input = (unsigned char *) realloc (input, size);
+		}
+		ssize_t r = read (fd, input + input_len, size - input_len);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) break;
+		input_len += r;
+	}
+	close (fd);
+
+	scan_blocks ();
+	int p[2];
+	if (pipe (p)) {
+		perror ("pipe");
+		exit (1);
+	}
+	fcntl (p[1], F_SETPIPE_SZ, PIPE_SIZE);
+	outfd = p[1];
+	next_job = 0;
+	writing = 0;
+	stopping = false;
+	failed = false;
+	nthreads = threads < 1 ? 1 : threads;
+	workers = new pthread_t[nthreads];
+	for (int i=0; i<nthreads; i++) pthread_create (&workers[i], NULL, work, NULL);
+	pthread_create (&writer, NULL, write_blocks, NULL);
+	return p[0];
+}
+
+// whether the output stopped at a block that didn't decompress, so that
+// the end of file the reader got isn't the end of the trace
+
+bool bunzip_failed (void) {
+	pthread_mutex_lock (&lock);
+	bool f = failed;
+	pthread_mutex_unlock (&lock);
+	return f;
+}
+
+// wait for the threads and free everything.  the reader must have closed
+// its end of the pipe
+
+void end_bunzip (void) {
+	if (!workers) return;
+	pthread_join (writer, NULL);
+	for (int i=0; i<nthreads; i++) pthread_join (workers[i], NULL);
+	delete[] workers;
+	workers = NULL;
+	for (int i=0; i<nblocks; i++) free (blocks[i].out);
+	free (blocks);
+	free (input);
+	blocks = NULL;
+	input = NULL;
+}
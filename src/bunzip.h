@@ -0,0 +1,16 @@
+// bunzip.h
+// This file declares a parallel bzip2 decompressor for trace files.  A
+// bzip2 stream is a series of blocks of up to 900 KB that are compressed
+// independently, so once the block boundaries are found each block can be
+// decompressed on its own.  The decompressor finds them by scanning for the
+// 48-bit block header, which can start at any bit, decompresses the blocks
+// on a pool of threads with libbz2, and writes them out in order into a
+// pipe for the trace reader, as an external bzip2 -dc would.  The whole
+// compressed input is read into memory before the scan, so trace.cc only
+// uses it for files; a pipe is left to bzip2 -dc, which streams.  A header
+// pattern that turns up by chance inside a block only costs a retry: a
+// block that doesn't decompress is retried up to the boundary after next.
+
+int start_bunzip (int, const unsigned char *, unsigned int, int);
+bool bunzip_failed (void);
+void end_bunzip (void);
@@ -0,0 +1,157 @@
+// cache.cc
+// This file contains the result cache declared in cache.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+// one entry of the index: a key and where its line starts in the results
+
+struct index_entry {
+	unsigned long long int h[2];
+	unsigned long long int offset;
+};
+
+#define DIGEST_BLOCK	(1<<20)
+
+void init_key (cache_key *k) {
+	k->h[0] = 0x243f6a8885a308d3ULL;
+	k->h[1] = 0x13198a2e03707344ULL;
+}
+
+// mix one 64-bit word into both halves of the key
+
+static inline void mix (cache_key *k, unsigned long long int w) {
+	k->h[0] = (k->h[0] ^ w) * 0x9e3779b97f4a7c15ULL;
+	k->h[0] ^= k->h[0] >> 32;
+	k->h[1] = (k->h[1] + w) * 0xc2b2ae3d27d4eb4fULL;
+	k->h[1] = (k->h[1] << 31) | (k->h[1] >> 33);
+}
+
+// add n bytes at p to the key, a word at a time, then their count so that
+// where one call ends and the next begins matters
+
+void digest_bytes (cache_key *k, const void *p, unsigned long long int n) {
+	const unsigned char *b = (const unsigned char *) p;
+	unsigned long long int i, w;
+
+	for (i=0; i+8<=n; i+=8) {
+		memcpy (&w, b + i, 8);
+		mix (k, w);
+	}
+	for (w=0; i<n; i++) w = (w << 8) | b[i];
+	mix (k, w);
+	mix (k, n);
+}
+
+void digest_string (cache_key *k, const char *s) {
+	digest_bytes (k, s, strlen (s));
+}
+
+// add the contents of the named file to the key; false if it can't be read
+
+bool digest_file (cache_key *k, const char *name) {
+	FILE *f = fopen (name, "r");
+	if (!f) return false;
+	unsigned char *buf = (unsigned char *) malloc (DIGEST_BLOCK);
+	size_t n;
+	while ((n = fread (buf, 1, DIGEST_BLOCK, f)) > 0) digest_bytes (k, buf, n);
+	bool ok = !ferror (f);
+	free (buf);
+	fclose (f);
+	return ok;
+}
+
+// the name of the index of the named results file
+
+static char *index_name (const char *name) {
+	char *s = (char *) malloc (strlen (name) + 5);
+	strcpy (s, name);
+	strcat (s, ".idx");
+	return s;
+}
+
+// find the newest result for k in the named cache; false if there isn't one
+
+bool cache_lookup (const char *name, const cache_key *k, cache_result *r) {
+	int fd = open (name, O_RDONLY);
+	if (fd < 0) return false;
+	flock (fd, LOCK_SH);
+
+	bool found = false;
+	unsigned long long int offset = 0;
+	char *iname = index_name (name);
+	FILE *idx = fopen (iname, "r");
+	free (iname);
+	if (idx) {
+		// a torn last entry from a writer that died is ignored by fread
+
+		index_entry e;
+		while (fread (&e, sizeof (e), 1, idx) == 1) {
+			if (e.h[0] == k->h[0] && e.h[1] == k->h[1]) {
+				offset = e.offset;
+				found = true;
+			}
+		}
+		fclose (idx);
+	}
+	if (found) {
+		char line[256];
+		ssize_t n = pread (fd, line, sizeof (line) - 1, offset);
+		line[n > 0 ? n : 0] = 0;
+		found = sscanf (line, "%*s %lld %lld %lld %lf",
+			&r->conditional_total, &r->dmiss, &r->tmiss, &r->seconds) == 4;
+	}
+	flock (fd, LOCK_UN);
+	close (fd);
+	return found;
+}
+
+// append r as the result for k to the named cache, with a description of
+// the run for people reading the file.  a cache that can't be written is
+// reported but isn't an error; the run still has its result
+
+void cache_store (const char *name, const cache_key *k, const cache_result *r, const char *description) {
+	int fd = open (name, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	if (fd < 0) {
+		perror (name);
+		return;
+	}
+	flock (fd, LOCK_EX);
+
+	char *iname = index_name (name);
+	int ifd = open (iname, O_WRONLY | O_CREAT, 0666);
+	if (ifd < 0) perror (iname);
+	free (iname);
+
+	// append the line, then its index entry.  an entry past the end of a
+	// torn index would be misaligned, so cut the index to whole entries
+
+	struct stat st;
+	if (ifd >= 0 && fstat (fd, &st) == 0) {
+		char line[1024];
+		int n = snprintf (line, sizeof (line), "%016llx%016llx %lld %lld %lld %0.3f %s\n",
+			k->h[0], k->h[1], r->conditional_total, r->dmiss, r->tmiss, r->seconds, description);
+		if (n >= (int) sizeof (line)) {
+			line[sizeof (line) - 2] = '\n';
+			n = sizeof (line) - 1;
+		}
+		index_entry e = { { k->h[0], k->h[1] }, (unsigned long long int) st.st_size };
+		struct stat ist;
+		if (write (fd, line, n) == n && fstat (ifd, &ist) == 0) {
+			off_t end = ist.st_size / sizeof (e) * sizeof (e);
+			if (ftruncate (ifd, end) || pwrite (ifd, &e, sizeof (e), end) != (ssize_t) sizeof (e))
+				perror ("cache_store");
+		} else
+			perror ("cache_store");
+	}
+	if (ifd >= 0) close (ifd);
+	flock (fd, LOCK_UN);
+	close (fd);
+}
@@ -0,0 +1,29 @@
+// cache.h
+// This file declares a persistent cache of simulation results.  A run is
+// keyed by a 128-bit digest of everything that decides its outcome: the
+// contents of the trace file (or the description of a synthetic stream),
+// the options that change the replay, the predictor configuration and the
+// code itself, taken as the digest of the predict executable.  Results
+// are appended to a text file, one line per run, and the key and offset of
+// each line to a binary index beside it (the file name plus ".idx"), so a
+// lookup reads the index and one line.  Writers hold an exclusive flock on
+// the results file while they append and readers a shared one, so parallel
+// runs can share a cache; the newest line for a key wins.
+
+struct cache_key {
+	unsigned long long int h[2];
+};
+
+// what is kept for a run
+
+struct cache_result {
+	long long int conditional_total, tmiss, dmiss;
+	double seconds;		// wall-clock time of the replay
+};
+
+void init_key (cache_key *);
+void digest_bytes (cache_key *, const void *, unsigned long long int);
+void digest_string (cache_key *, const char *);
+bool digest_file (cache_key *, const char *);
+bool cache_lookup (const char *, const cache_key *, cache_result *);
+void cache_store (const char *, const cache_key *, const cache_result *, const char *);
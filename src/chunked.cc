@@ -0,0 +1,130 @@
+// chunked.cc
+// This file contains the parallel replay declared in chunked.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "stats.h"
+#include "chunked.h"
+
+// read the traces from next, or only the first max of them if max isn't
+// -1, into one array; return it and its length in n.  a trace file is
+// decoded a block at a time (see read_traces)
+
+packed_trace *load_traces (trace *(*next) (void), long long int max, long long int *n) {
+	long long int size = 1 << 20;
+	packed_trace *a = (packed_trace *) malloc (size * sizeof (packed_trace));
+	trace_block *b = next == read_trace ? (trace_block *) malloc (sizeof (trace_block)) : NULL;
+	trace t;
+	int k = 0, i = 0;
+
+	*n = 0;
+	while (max < 0 || *n < max) {
+		if (b) {
+			if (i == k) {
+				long long int want = max < 0 || max - *n > TRACE_BLOCK ? TRACE_BLOCK : max - *n;
+				k = read_traces (b, want);
+				i = 0;
+				if (!k) break;
+			}
+			t.bi.address = b->address[i];
+			t.target = b->target[i];
+			t.bi.br_flags = b->flags[i] >> 4;
+			t.bi.opcode = b->flags[i] & 15;
+			t.taken = (b->taken[i/64] >> (i % 64)) & 1;
+			i++;
+		} else {
+			trace *p = next ();
+			if (!p) break;
+			t = *p;
+		}
+		if (*n == size) {
+			size *= 2;
+			a = (packed_trace *) realloc (a, size * sizeof (packed_trace));
+		}
+		if (!a) {
+			perror ("load_traces");
+			exit (1);
+		}
+		pack_trace (&t, &a[(*n)++]);
+	}
+	free (b);
+	return a;
+}
+
+// feed traces [from, to) to p, counting mispredictions into s and, unless
+// it is NULL, per-class statistics into cs.  a NULL s just warms up the
+// predictor
+
+void replay_range (branch_predictor *p, packed_trace *traces, long long int from, long long int to, replay_stats *s, class_stats *cs) {
+	trace t;
+
+	for (long long int i=from; i<to; i++) {
+		unpack_trace (&traces[i], &t);
+		branch_update *u = p->predict_and_update (t.bi, t.taken, t.target);
+		if (s && (t.bi.br_flags & BR_CONDITIONAL)) {
+			s->dmiss += u->direction_prediction () != t.taken;
+			s->tmiss += u->target_prediction () != t.target;
+			s->conditional_total++;
+		}
+		if (s && cs) count_branch (cs, &t, u);
+	}
+}
+
+// one chunk's share of the work
+
+struct chunk {
+	pthread_t thread;
+	packed_trace *traces;
+	long long int warm, from, to;
+	branch_predictor *(*make) (void);
+	replay_stats s;
+	class_stats *cs;	// NULL if not wanted
+};
+
+static void *replay_chunk (void *arg) {
+	chunk *c = (chunk *) arg;
+	branch_predictor *p = c->make ();
+
+	replay_range (p, c->traces, c->warm, c->from, NULL, NULL);
+	replay_range (p, c->traces, c->from, c->to, &c->s, c->cs);
+	delete p;
+	return NULL;
+}
+
+// replay n traces in k chunks on k threads, each into a new predictor from
+// make that has first seen the warmup traces before its chunk, and add up
+// the statistics in s and, unless it is NULL, cs
+
+void replay_chunked (packed_trace *traces, long long int n, int k, long long int warmup, branch_predictor *(*make) (void), replay_stats *s, class_stats *cs) {
+	chunk *c = new chunk[k];
+
+	for (int i=0; i<k; i++) {
+		c[i].traces = traces;
+		c[i].from = n * i / k;
+		c[i].to = n * (i + 1) / k;
+		c[i].warm = c[i].from > warmup ? c[i].from - warmup : 0;
+		c[i].make = make;
+		c[i].cs = cs ? new class_stats : NULL;
+		if (pthread_create (&c[i].thread, NULL, replay_chunk, &c[i])) {
+			perror ("pthread_create");
+			exit (1);
+		}
+	}
+	for (int i=0; i<k; i++) {
+		pthread_join (c[i].thread, NULL);
+		s->conditional_total += c[i].s.conditional_total;
+		s->tmiss += c[i].s.tmiss;
+		s->dmiss += c[i].s.dmiss;
+		if (cs) {
+			add_class_stats (cs, c[i].cs);
+			delete c[i].cs;
+		}
+	}
+	delete[] c;
+}
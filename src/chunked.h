@@ -0,0 +1,21 @@
+// chunked.h
+// This file declares an approximate parallel replay of a single trace.  The
+// trace is kept in memory and split into chunks that are replayed on their
+// own threads, each into a fresh predictor warmed up on the traces just
+// before the chunk.  The miss counts are close to, but not the same as, a
+// serial replay; the serial replay in predict.cc stays the exact reference.
+
+// statistics from replaying some traces; just for conditional branches
+
+struct replay_stats {
+	long long int 
+		conditional_total,
+		tmiss,		// number of target mispredictions
+		dmiss;		// number of direction mispredictions
+
+	replay_stats (void) : conditional_total(0), tmiss(0), dmiss(0) {}
+};
+
+packed_trace *load_traces (trace *(*) (void), long long int, long long int *);
+void replay_range (branch_predictor *, packed_trace *, long long int, long long int, replay_stats *, class_stats *);
+void replay_chunked (packed_trace *, long long int, int, long long int, branch_predictor *(*) (void), replay_stats *, class_stats *);
@@ -0,0 +1,345 @@
+// explore.cc
+// This file contains a design-space exploration driver for the Piecewise
+// predictor.  Given a storage budget in bytes it enumerates the geometries
+// (M, N, H) whose storage M*N*(H+1) + 4*H (see piecewise.h) fits in the
+// budget, builds predict_M_N_H for each with make, and evaluates them in
+// parallel on a set of traces.  Evaluation goes in rounds on growing
+// prefixes of the traces, in the manner of successive halving: after each
+// round, configurations that are clearly behind a configuration of no more
+// storage are dropped, and of the rest only the 1/eta that are closest to
+// the best accuracy achievable at their size go on to the next round.  The
+// survivors are run on the full traces and printed as a table of MPKI
+// against bytes with the Pareto-optimal points marked.
+//
+// explore [-j jobs] [-e eta] [-p prefix] [-x max-prefix] [-f fill] [-d dir] [-c cache] <budget> <trace> ...
+//
+// -j	number of simulations to run at once (default: number of CPUs)
+// -e	keep 1/eta of the configurations each round (default 3)
+// -p	length in traces of the first round's prefix (default 1000000)
+// -x	prefixes stop growing here before the full run (default 10000000)
+// -f	only consider geometries using at least this fraction of the
+//	budget (default 0.5)
+// -d	directory with the Makefile and predict sources (default .)
+// -c	result cache for the simulations (see cache.h), so that a sweep
+//	repeated with a bigger budget or more traces only runs what's new
+//
+// Run it from the src directory, e.g.
+//
+// explore 8192 ../traces/*/*.trace.bz2
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// the values of H to try.  GHR is 64 bits wide so H can't be more than 63
+
+static const int hlist[] = { 8, 12, 16, 20, 24, 28, 32, 40, 48, 56, 63 };
+
+#define NH	(int) (sizeof (hlist) / sizeof (hlist[0]))
+
+// largest M or N to try
+
+#define MAX_DIM	(1<<16)
+
+// one point in the design space
+
+struct config {
+	int m, n, h;
+	long long int bytes;	// storage from the formula in piecewise.h
+	bool alive;		// still in the running
+	double rate;		// mean miss rate over the traces, last round
+	double mpki;		// mean MPKI over the traces, full run only
+	double gap;		// rate relative to the best rate at this size
+};
+
+// one simulation: a configuration run on a trace
+
+struct job {
+	config *c;
+	int trace;
+	pid_t pid;
+	int fd;			// read end of the pipe from its stdout
+	char out[256];
+	int outlen;
+	double mpki, rate;
+};
+
+static const char *dir = ".";
+static const char *cache_name;
+static int njobs;
+
+// compare configurations by storage
+
+static int by_bytes (const void *a, const void *b) {
+	const config *x = (const config *) a, *y = (const config *) b;
+	if (x->bytes != y->bytes) return x->bytes < y->bytes ? -1 : 1;
+	if (x->m != y->m) return x->m - y->m;
+	return x->n - y->n;
+}
+
+// compare configurations by gap
+
+static int by_gap (const void *a, const void *b) {
+	const config *x = *(const config **) a, *y = *(const config **) b;
+	if (x->gap != y->gap) return x->gap < y->gap ? -1 : 1;
+	return 0;
+}
+
+// the name of the binary for a configuration
+
+static void binary_name (config *c, char *s, int len) {
+	snprintf (s, len, "predict_%d_%d_%d", c->m, c->n, c->h);
+}
+
+// start a simulation; return false if it couldn't be started
+
+static bool start_job (job *j, char **traces, long long int prefix) {
+	char bin[64], path[1024], nbuf[32];
+	const char *args[8];
+	int p[2], nargs = 0;
+
+	binary_name (j->c, bin, sizeof (bin));
+	snprintf (path, sizeof (path), "%s/%s", dir, bin);
+	snprintf (nbuf, sizeof (nbuf), "%lld", prefix);
+	args[nargs++] = bin;
+	if (cache_name) {
+		args[nargs++] = "-C";
+		args[nargs++] = cache_name;
+	}
+	if (prefix) {
+		args[nargs++] = "-n";
+		args[nargs++] = nbuf;
+	}
+	args[nargs++] = traces[j->trace];
+	args[nargs] = NULL;
+	if (pipe (p)) {
+		perror ("pipe");
+		return false;
+	}
+	j->pid = fork ();
+	if (j->pid == 0) {
+		dup2 (p[1], 1);
+		close (p[0]);
+		close (p[1]);
+		execv (path, (char **) args);
+		perror (path);
+		_exit (1);
+	}
+	close (p[1]);
+	if (j->pid < 0) {
+		perror ("fork");
+		close (p[0]);
+		return false;
+	}
+	j->fd = p[0];
+	j->outlen = 0;
+	return true;
+}
+
+// collect a finished simulation's results; return false if it failed
+
+static bool finish_job (job *j, int status) {
+	ssize_t n;
+
+	while ((n = read (j->fd, j->out + j->outlen, sizeof (j->out) - 1 - j->outlen)) > 0)
+		j->outlen += n;
+	close (j->fd);
+	j->out[j->outlen] = 0;
+	if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) return false;
+	return sscanf (j->out, "%lf MPKI %lf", &j->mpki, &j->rate) == 2;
+}
+
+// run every live configuration on every trace, njobs at a time, and record
+// the mean MPKI and miss rate of each.  prefix 0 means the full traces
+
+static void run_round (config *cs, int ncs, char **traces, int ntraces, long long int prefix) {
+	int total = 0;
+	for (int i=0; i<ncs; i++) if (cs[i].alive) total += ntraces;
+	job *jobs = new job[total];
+	int k = 0;
+	for (int i=0; i<ncs; i++) {
+		if (!cs[i].alive) continue;
+		cs[i].rate = 0;
+		cs[i].mpki = 0;
+		for (int t=0; t<ntraces; t++) {
+			jobs[k].c = &cs[i];
+			jobs[k].trace = t;
+			jobs[k].pid = -1;
+			k++;
+		}
+	}
+
+	// keep njobs simulations going until they are all done
+
+	int next = 0, running = 0, done = 0;
+	while (done < total) {
+		while (running < njobs && next < total) {
+			if (!start_job (&jobs[next], traces, prefix)) exit (1);
+			next++;
+			running++;
+		}
+		int status;
+		pid_t pid = waitpid (-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+			perror ("waitpid");
+			exit (1);
+		}
+		for (int i=0; i<next; i++) {
+			if (jobs[i].pid != pid) continue;
+			if (!finish_job (&jobs[i], status)) {
+				char bin[64];
+				binary_name (jobs[i].c, bin, sizeof (bin));
+				fprintf (stderr, "%s failed on %s\n", bin, traces[jobs[i].trace]);
+				exit (1);
+			}
+			jobs[i].c->rate += jobs[i].rate / ntraces;
+			jobs[i].c->mpki += jobs[i].mpki / ntraces;
+			jobs[i].pid = -1;
+			running--;
+			done++;
+			break;
+		}
+	}
+	delete[] jobs;
+}
+
+// drop configurations that are behind.  cs is sorted by bytes.  a
+// configuration's gap is its miss rate over the best rate of any
+// configuration no bigger than it; a gap over 1 + margin is clearly behind.
+// of the rest, keep the 1/eta with the smallest gaps
+
+static int prune (config *cs, int ncs, int eta, double margin) {
+	double best = 0;
+	int alive = 0;
+	config **live = new config *[ncs];
+
+	for (int i=0; i<ncs; i++) {
+		if (!cs[i].alive) continue;
+		if (!alive || cs[i].rate < best) best = cs[i].rate;
+		cs[i].gap = best > 0 ? cs[i].rate / best : 1;
+		if (cs[i].gap > 1 + margin)
+			cs[i].alive = false;
+		else
+			live[alive++] = &cs[i];
+	}
+	qsort (live, alive, sizeof (config *), by_gap);
+	int keep = (alive + eta - 1) / eta;
+	for (int i=keep; i<alive; i++) live[i]->alive = false;
+	delete[] live;
+	return alive < keep ? alive : keep;
+}
+
+static void usage (char *prog) {
+	fprintf (stderr, "Usage: %s [-j jobs] [-e eta] [-p prefix] [-x max-prefix] [-f fill] [-d dir] [-c cache] <budget> <trace> ...\n", prog);
+	exit (1);
+}
+
+int main (int argc, char *argv[]) {
+	int eta = 3, opt;
+	long long int prefix = 1000000, max_prefix = 10000000;
+	double fill = 0.5, margin = 0.05;
+
+	njobs = sysconf (_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt (argc, argv, "j:e:p:x:f:d:c:")) != -1) {
+		switch (opt) {
+		case 'j': njobs = atoi (optarg); break;
+		case 'e': eta = atoi (optarg); break;
+		case 'p': prefix = atoll (optarg); break;
+		case 'x': max_prefix = atoll (optarg); break;
+		case 'f': fill = atof (optarg); break;
+		case 'd': dir = optarg; break;
+		case 'c': cache_name = optarg; break;
+		default: usage (argv[0]);
+		}
+	}
+	if (argc - optind < 2 || njobs < 1 || eta < 2 || prefix < 1) usage (argv[0]);
+	long long int budget = atoll (argv[optind]);
+	char **traces = &argv[optind+1];
+	int ntraces = argc - optind - 1;
+
+	// enumerate the geometries that fit, with M and N powers of two
+
+	int max = 0;
+	for (int m=1; m<=MAX_DIM; m*=2) for (int n=1; n<=MAX_DIM; n*=2) max += NH;
+	config *cs = new config[max];
+	int ncs = 0;
+	for (int m=1; m<=MAX_DIM; m*=2) for (int n=1; n<=MAX_DIM; n*=2) for (int i=0; i<NH; i++) {
+		int h = hlist[i];
+		long long int bytes = (long long int) m * n * (h+1) + 4 * h;
+		if (bytes > budget || bytes < fill * budget) continue;
+		config *c = &cs[ncs++];
+		c->m = m;
+		c->n = n;
+		c->h = h;
+		c->bytes = bytes;
+		c->alive = true;
+	}
+	if (!ncs) {
+		fprintf (stderr, "no geometry uses between %g and %lld bytes\n", fill * budget, budget);
+		exit (1);
+	}
+	qsort (cs, ncs, sizeof (config), by_bytes);
+	fprintf (stderr, "%d geometries fit in %lld bytes\n", ncs, budget);
+
+	// build all the binaries with one parallel make
+
+	char **margv = new char *[ncs + 6];
+	char jbuf[32];
+	int margc = 0;
+	snprintf (jbuf, sizeof (jbuf), "-j%d", njobs);
+	margv[margc++] = (char *) "make";
+	margv[margc++] = (char *) "-s";
+	margv[margc++] = (char *) "-C";
+	margv[margc++] = (char *) dir;
+	margv[margc++] = jbuf;
+	for (int i=0; i<ncs; i++) {
+		char bin[64];
+		binary_name (&cs[i], bin, sizeof (bin));
+		margv[margc++] = strdup (bin);
+	}
+	margv[margc] = NULL;
+	pid_t pid = fork ();
+	if (pid == 0) {
+		execvp ("make", margv);
+		perror ("make");
+		_exit (1);
+	}
+	int status;
+	if (pid < 0 || waitpid (pid, &status, 0) < 0 || !WIFEXITED (status) || WEXITSTATUS (status)) {
+		fprintf (stderr, "building the predictors failed\n");
+		exit (1);
+	}
+
+	// successive rounds on growing prefixes
+
+	int alive = ncs;
+	for (; prefix <= max_prefix && alive > 1; prefix *= eta) {
+		run_round (cs, ncs, traces, ntraces, prefix);
+		int was = alive;
+		alive = prune (cs, ncs, eta, margin);
+		fprintf (stderr, "prefix %lld: %d of %d configurations left\n", prefix, alive, was);
+	}
+
+	// the survivors get the full traces
+
+	run_round (cs, ncs, traces, ntraces, 0);
+	printf ("%6s %6s %3s %10s %10s %10s %s\n", "M", "N", "H", "bytes", "MPKI", "miss rate", "pareto");
+	for (int i=0; i<ncs; i++) {
+		if (!cs[i].alive) continue;
+
+		// a point is on the frontier if nothing as small does better
+
+		bool pareto = true;
+		for (int j=0; j<ncs; j++)
+			if (cs[j].alive && cs[j].bytes <= cs[i].bytes && cs[j].mpki < cs[i].mpki)
+				pareto = false;
+		printf ("%6d %6d %3d %10lld %10.3f %10.6f %s\n", cs[i].m, cs[i].n, cs[i].h,
+			cs[i].bytes, cs[i].mpki, cs[i].rate, pareto ? "*" : "");
+	}
+	exit (0);
+}
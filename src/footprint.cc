@@ -0,0 +1,445 @@
+// footprint.cc
+// This file contains the main function for footprint, which makes one pass
+// over a trace and describes the conditional branches in it the way that
+// matters for sizing predictor tables: how many static branches there are
+// and how the executions are spread over them, how many other static
+// branches come between two executions of one (the reuse distance, so an
+// LRU table of 2^k entries would hold the branches of every reuse below
+// 2^k), how often the rows, columns and gshare entries a predictor would
+// index are shared by different branches, and how many bytes the entries
+// actually used take.  Columns are modelled the way Piecewise selects
+// them: the branch i back in its path history GA picks the column of its
+// own address for history position i, so the column aliasing counted is
+// that of GA[i] % M at every position.  Geometries that are clearly too
+// small or too big for a trace can then be left out of a sweep (see
+// explore.cc) without running them.
+//
+// footprint [-n traces] [-M m] [-N n] [-H h] [-b bits] [-g bits] [-t top] <trace>
+//
+// -n	only look at the first n traces
+// -M, -N, -H	the Piecewise geometry (default 256, 1 and 32, as in
+//	piecewise.h): rows are address % N and columns GA address % M
+// -b, -g	the gshare table and history bits (default 15 and 15, as in
+//	my_predictor.h)
+// -t	how many of the hottest branches to list (default 10)
+//
+// The trace can be anything predict reads, including synth: streams.
+// Reuse distances are computed as they stream by with a Fenwick tree
+// over the time of each branch's last execution (see reuse_distance), so
+// the pass costs O(log n + H) per branch, n being the number of static
+// branches, and a run of the same branch (see read_run) costs at most as
+// much as H+1 executions of it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "synth.h"
+
+// what is known about one static conditional branch
+
+struct site {
+	unsigned int address;
+	long long int count, taken;	// executions, and how many were taken
+	unsigned int last;		// position of its last execution in the Fenwick tree
+};
+
+static site *sites;
+static unsigned int nsites, max_sites;
+
+// open addressing hash table from addresses to 1 + their index in sites,
+// 0 for an empty slot.  kept at most half full
+
+static unsigned int *slots;
+static unsigned int slot_mask;
+
+// every table here is allocated through this, so running out of memory
+// is an error rather than a crash
+
+static void *check_alloc (void *p) {
+	if (!p) {
+		perror ("footprint");
+		exit (1);
+	}
+	return p;
+}
+
+static unsigned int hash_address (unsigned int a) {
+	return (a * 0x9e3779b1U) >> 7;
+}
+
+static void grow_slots (void) {
+	unsigned int n = slots ? 2 * (slot_mask + 1) : 1<<12;
+	free (slots);
+	slots = (unsigned int *) check_alloc (calloc (n, sizeof (unsigned int)));
+	slot_mask = n - 1;
+	for (unsigned int i=0; i<nsites; i++) {
+		unsigned int h = hash_address (sites[i].address) & slot_mask;
+		while (slots[h]) h = (h + 1) & slot_mask;
+		slots[h] = i + 1;
+	}
+}
+
+// the index in sites of the branch at address, adding it if it is new
+
+static unsigned int find_site (unsigned int address, bool *added) {
+	unsigned int h = hash_address (address) & slot_mask;
+	for (; slots[h]; h = (h + 1) & slot_mask)
+		if (sites[slots[h]-1].address == address) {
+			*added = false;
+			return slots[h] - 1;
+		}
+	if (nsites == max_sites) {
+		max_sites = max_sites ? 2 * max_sites : 1<<12;
+		sites = (site *) check_alloc (realloc (sites, max_sites * sizeof (site)));
+	}
+	site *s = &sites[nsites];
+	s->address = address;
+	s->count = 0;
+	s->taken = 0;
+	s->last = 0;
+	slots[h] = ++nsites;
+	*added = true;
+	if (2 * nsites > slot_mask) grow_slots ();
+	return nsites - 1;
+}
+
+// the reuse distance of an execution is the number of marks in a Fenwick
+// tree between the last execution of the same branch and now, where each
+// branch has one mark at the time of its last execution.  time only moves
+// forward, so when it reaches the end of the tree the marks are renumbered
+// 1 to nsites in order and time goes on from there; the tree is kept at
+// least twice as big as nsites, so that costs O(1) a branch
+
+static int *tree;		// positions 1 to tree_size
+static unsigned int *owner;	// the site that put a mark at each position
+static unsigned int tree_size, now;
+
+static void tree_add (unsigned int i, int v) {
+	for (; i<=tree_size; i+=i&-i) tree[i] += v;
+}
+
+static unsigned int tree_sum (unsigned int i) {
+	int s = 0;
+	for (; i; i-=i&-i) s += tree[i];
+	return s;
+}
+
+static void renumber (void) {
+	unsigned int size = tree_size;
+	while (size < 4 * (nsites + 1)) size = size ? 2 * size : 1<<16;
+	unsigned int *o = (unsigned int *) check_alloc (malloc ((size + 1) * sizeof (unsigned int)));
+	unsigned int n = 0;
+	for (unsigned int i=1; i<=now; i++) {
+		site *s = &sites[owner[i]];
+		if (s->last == i) {
+			s->last = ++n;
+			o[n] = owner[i];
+		}
+	}
+	free (owner);
+	owner = o;
+	free (tree);
+	tree = (int *) check_alloc (calloc (size + 1, sizeof (int)));
+	tree_size = size;
+	now = n;
+
+	// a linear time build of a tree with marks at 1 to n
+
+	for (unsigned int i=1; i<=tree_size; i++) {
+		tree[i] += i <= n;
+		unsigned int j = i + (i&-i);
+		if (j <= tree_size) tree[j] += tree[i];
+	}
+}
+
+// move the mark of site i to now and return its reuse distance, or -1 the
+// first time
+
+static long long int reuse_distance (unsigned int i) {
+	site *s = &sites[i];
+	if (now == tree_size) renumber ();
+	now++;
+	long long int d = -1;
+	if (s->last) {
+		d = tree_sum (now - 1) - tree_sum (s->last);
+		tree_add (s->last, -1);
+	}
+	tree_add (now, 1);
+	owner[now] = i;
+	s->last = now;
+	return d;
+}
+
+// histograms are by powers of two: bucket 0 is 0, then 1, 2-3, 4-7 and so on
+
+#define BUCKETS	65
+
+static int bucket (long long int x) {
+	return x ? 64 - __builtin_clzll (x) : 0;
+}
+
+static void print_bucket (int b) {
+	if (b < 2)
+		printf ("  %d", b);
+	else
+		printf ("  %lld-%lld", 1LL << (b - 1), (1LL << b) - 1);
+}
+
+// a table indexed for each conditional branch.  it remembers which branch
+// used each entry last; a lookup aliases when that was another one
+
+struct index_table {
+	unsigned int size;
+	unsigned int *user;		// 1 + the site that used each entry last, 0 if none
+	bool *mixed;			// whether more than one branch used each entry
+	long long int lookups;
+	long long int aliased;		// lookups that found another branch's entry
+	unsigned int used;		// entries used at all
+	unsigned int shared;		// entries used by more than one branch
+
+	void init (unsigned int n) {
+		size = n;
+		user = (unsigned int *) check_alloc (calloc (n, sizeof (unsigned int)));
+		mixed = (bool *) check_alloc (calloc (n, sizeof (bool)));
+		lookups = aliased = 0;
+		used = shared = 0;
+	}
+
+	// site i looks up entry e, k times in a row
+
+	void touch (unsigned int e, unsigned int i, unsigned int k = 1) {
+		lookups += k;
+		used += !user[e];
+		if (user[e] && user[e] != i + 1) {
+			aliased++;
+			shared += !mixed[e];
+			mixed[e] = true;
+		}
+		user[e] = i + 1;
+	}
+
+	double aliased_percent (void) {
+		return lookups ? 100.0 * aliased / lookups : 0;
+	}
+};
+
+// where the traces come from, and how many more to take
+
+static trace *(*source) (void);
+static long long int remaining = -1;
+
+// get the next trace and how many times in a row it comes
+
+static trace *next_run (unsigned int *n) {
+	if (remaining == 0) return NULL;
+	trace *t;
+	if (source == read_trace) {
+		unsigned int max = remaining > 0 && remaining < ~0U ? remaining : ~0U;
+		t = read_run (max, n);
+	} else {
+		t = source ();
+		*n = 1;
+	}
+	if (t && remaining > 0) remaining -= *n;
+	return t;
+}
+
+static int by_count (const void *a, const void *b) {
+	long long int x = ((site *) a)->count, y = ((site *) b)->count;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void usage (char *prog) {
+	fprintf (stderr, "Usage: %s [-n traces] [-M m] [-N n] [-H h] [-b bits] [-g bits] [-t top] <trace>\n", prog);
+	exit (1);
+}
+
+int main (int argc, char *argv[]) {
+	unsigned int m = 256, n = 1, h = 32, gbits = 15, ghist = 15, top = 10;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "n:M:N:H:b:g:t:")) != -1) {
+		switch (opt) {
+		case 'n': remaining = atoll (optarg); break;
+		case 'M': m = atoi (optarg); break;
+		case 'N': n = atoi (optarg); break;
+		case 'H': h = atoi (optarg); break;
+		case 'b': gbits = atoi (optarg); break;
+		case 'g': ghist = atoi (optarg); break;
+		case 't': top = atoi (optarg); break;
+		default: usage (argv[0]);
+		}
+	}
+	if (optind != argc - 1 || m < 1 || n < 1 || h < 1 || h > 63 || gbits < 1 || gbits > 30 || ghist > gbits)
+		usage (argv[0]);
+
+	// the column and weight tables are indexed with unsigned ints, so
+	// a geometry with more entries than that is refused rather than
+	// wrapped
+
+	unsigned long long int column_entries = (unsigned long long int) m * h;
+	unsigned long long int weight_entries = (unsigned long long int) n * m * (h + 1);
+	if (weight_entries > 0xffffffffULL) {
+		fprintf (stderr, "%s: M=%u N=%u H=%u has too many weights to follow\n", argv[0], m, n, h);
+		exit (1);
+	}
+	char *fname = argv[optind];
+
+	if (strncmp (fname, SYNTH_PREFIX, strlen (SYNTH_PREFIX)) == 0) {
+		synth_params sp;
+		if (!parse_synth (fname, sp)) {
+			fprintf (stderr, "%s: bad stream description \"%s\"\n", argv[0], fname);
+			exit (1);
+		}
+		init_synth (sp);
+		source = read_synth;
+	} else {
+		init_trace (fname);
+		source = read_trace;
+	}
+
+	grow_slots ();
+	renumber ();
+	index_table rows, columns, weights, gshare;
+	rows.init (n);
+	columns.init (column_entries);
+	weights.init (weight_entries);
+	gshare.init (1 << gbits);
+	unsigned int ghr = 0;
+
+	// Piecewise's GA: the sites of the last h conditional branches, the
+	// latest at ga[(ga_head + h - 1) % h]
+
+	unsigned int *ga = (unsigned int *) check_alloc (calloc (h, sizeof (unsigned int)));
+	unsigned int ga_head = 0, ga_size = 0;
+	long long int branches = 0, conditional = 0, reuses[BUCKETS];
+	memset (reuses, 0, sizeof (reuses));
+
+	for (;;) {
+		unsigned int k;
+		trace *t = next_run (&k);
+		if (!t) break;
+		branches += k;
+		if (!(t->bi.br_flags & BR_CONDITIONAL)) continue;
+		conditional += k;
+
+		// the repeats of a run come right after the branch itself, so
+		// their reuse distance is 0 and they can't alias its row
+
+		bool added;
+		unsigned int i = find_site (t->bi.address, &added);
+		site *s = &sites[i];
+		s->count += k;
+		s->taken += t->taken ? k : 0;
+		long long int d = reuse_distance (i);
+		if (d >= 0) reuses[bucket (d)]++;
+		reuses[0] += k - 1;
+		unsigned int row = t->bi.address % n;
+		rows.touch (row, i, k);
+
+		// history position p pairs the branch p+1 back in GA with the
+		// column of its address, as W[row][GA[p] % M][p] in piecewise.h;
+		// the bias is W[row][0][0].  the window changes until it is full
+		// of the run's branch, and then the run stays on the same
+		// entries, so the last time counts for the rest of the run
+
+		unsigned int last = k < h + 1 ? k : h + 1;
+		for (unsigned int j=0; j<last; j++) {
+			unsigned int times = j == last - 1 ? k - j : 1;
+			weights.touch (row * m * (h + 1), i, times);
+			for (unsigned int p=0; p<ga_size; p++) {
+				unsigned int g = ga[(ga_head + h - 1 - p) % h];
+				unsigned int column = sites[g].address % m;
+				columns.touch (column * h + p, g, times);
+				weights.touch ((row * m + column) * (h + 1) + p, i, times);
+			}
+			ga[(ga_head + ga_size) % h] = i;
+			if (ga_size < h)
+				ga_size++;
+			else
+				ga_head = (ga_head + 1) % h;
+		}
+
+		// the same goes for the gshare index and its history
+
+		last = k < ghist + 1 ? k : ghist + 1;
+		for (unsigned int j=0; j<last; j++) {
+			gshare.touch ((ghr << (gbits - ghist)) ^ (t->bi.address & ((1 << gbits) - 1)), i, j == last - 1 ? k - j : 1);
+			ghr = ((ghr << 1) | t->taken) & ((1 << ghist) - 1);
+		}
+	}
+	if (source == read_synth)
+		end_synth ();
+	else
+		end_trace ();
+
+	// the executions per branch, and how few branches make up most of them
+
+	qsort (sites, nsites, sizeof (site), by_count);
+	long long int counts[BUCKETS];
+	memset (counts, 0, sizeof (counts));
+	for (unsigned int i=0; i<nsites; i++) counts[bucket (sites[i].count)]++;
+	unsigned int cover[3] = { 0, 0, 0 };
+	const double fractions[3] = { 0.5, 0.9, 0.99 };
+	long long int sum = 0;
+	for (unsigned int i=0; i<nsites; i++) {
+		sum += sites[i].count;
+		for (int j=0; j<3; j++)
+			if (!cover[j] && sum >= fractions[j] * conditional) cover[j] = i + 1;
+	}
+
+	printf ("trace: %s\n", fname);
+	printf ("branches: %lld\n", branches);
+	printf ("conditional branches: %lld\n", conditional);
+	printf ("static conditional branches: %u\n", nsites);
+	printf ("static conditional branches making up 50%% 90%% 99%% of executions: %u %u %u\n", cover[0], cover[1], cover[2]);
+
+	printf ("\nexecutions of a static conditional branch: branches\n");
+	for (int b=1; b<BUCKETS; b++)
+		if (counts[b]) {
+			print_bucket (b);
+			printf (": %lld\n", counts[b]);
+		}
+
+	printf ("\nhottest static conditional branches: executions, %% of all, %% taken\n");
+	for (unsigned int i=0; i<nsites && i<top; i++)
+		printf ("  0x%08x: %lld %0.2f%% %0.2f%%\n", sites[i].address, sites[i].count,
+			100.0 * sites[i].count / conditional, 100.0 * sites[i].taken / sites[i].count);
+
+	printf ("\nreuse distance (other static conditional branches in between): reuses, cumulative %%\n");
+	long long int reused = conditional - nsites;
+	sum = 0;
+	for (int b=0; b<BUCKETS; b++)
+		if (reuses[b]) {
+			sum += reuses[b];
+			print_bucket (b);
+			printf (": %lld %0.2f%%\n", reuses[b], reused ? 100.0 * sum / reused : 0);
+		}
+	printf ("  first executions: %u\n", nsites);
+
+	// a column is looked up at each history position by the branch that
+	// far back in GA, so its users are those branches; a weight or a
+	// gshare counter is used by the branch being predicted
+
+	printf ("\naliasing: entries used, entries shared by more than one branch, %% of lookups finding another branch's entry\n");
+	printf ("  rows, address %% %u: %u %u %0.2f%%\n", n, rows.used, rows.shared, rows.aliased_percent ());
+	printf ("  columns, GA address %% %u at %u positions: %u %u %0.2f%%\n", m, h, columns.used, columns.shared, columns.aliased_percent ());
+	printf ("  piecewise weights: %u %u %0.2f%%\n", weights.used, weights.shared, weights.aliased_percent ());
+	printf ("  gshare, %u bits, %u history bits: %u %u %0.2f%%\n", gbits, ghist, gshare.used, gshare.shared, gshare.aliased_percent ());
+
+	// bytes: Piecewise has M*N*(H+1) char weights and 4*H bytes of GA
+	// (see piecewise.h), but only the weights looked up are ever touched;
+	// gshare has a byte a counter, as my_predictor.h stores them
+
+	long long int row_bytes = (long long int) m * (h + 1);
+	printf ("\nworking set: bytes used, of the whole table\n");
+	printf ("  piecewise M=%u N=%u H=%u: %lld of %lld\n", m, n, h,
+		(long long int) weights.used + 4 * h, row_bytes * n + 4 * h);
+	printf ("  piecewise, a row for each of the branches making up 99%%: %lld\n", row_bytes * cover[2] + 4 * h);
+	printf ("  gshare: %u of %u\n", gshare.used, 1 << gbits);
+	exit (0);
+}
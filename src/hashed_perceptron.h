@@ -0,0 +1,260 @@
+// hashed_perceptron.h
+// This file contains a hashed perceptron predictor.  Instead of one weight
+// per history bit, as in Piecewise, it has HP_TABLES small tables of
+// weights.  Table 0 is indexed by the branch address alone and gives the
+// bias; table i is indexed by a hash of the branch address and one segment
+// of the global history, [L(i-1), L(i)) with the lengths L growing
+// geometrically from HP_MIN_HIST to HP_MAX_HIST, so the history reaches far
+// back while a prediction still reads only HP_TABLES weights.  Each segment
+// is kept folded down to an index with a circular shift register that is
+// updated with two bits per branch, so the cost doesn't depend on the
+// history length either.  Training is the usual perceptron rule with a
+// threshold tuned online as with ADAPT_THETA in piecewise.h.
+//
+// Choose it with -DPREDICTOR=HashedPerceptron.
+// ****************************************************************
+// Variables that take up space: W, the history and the folded segments.
+// W is HP_TABLES tables of 1<<HP_TABLE_BITS char weights.
+// The history is HP_MAX_HIST bits.
+// Each folded segment is an HP_TABLE_BITS-bit register, counted as 4 bytes.
+// ****************************************************************
+// Space: HP_TABLES*2^HP_TABLE_BITS + HP_MAX_HIST/8 + 4*HP_TABLES bytes,
+// 8256 bytes by default; the threshold and its counter take 2 more.
+
+#ifndef HP_TABLES
+#define HP_TABLES	8
+#endif
+#ifndef HP_TABLE_BITS
+#define HP_TABLE_BITS	10
+#endif
+#ifndef HP_MIN_HIST
+#define HP_MIN_HIST	3
+#endif
+#ifndef HP_MAX_HIST
+#define HP_MAX_HIST	256
+#endif
+
+// size of the ring buffer holding the history: the smallest power of two
+// bigger than HP_MAX_HIST, so that an index into it can be masked.  the
+// bits below the top one of HP_MAX_HIST are all set, then one is added
+
+#define HP_SMEAR1(x)	((x) | (x) >> 1)
+#define HP_SMEAR2(x)	(HP_SMEAR1 (x) | HP_SMEAR1 (x) >> 2)
+#define HP_SMEAR4(x)	(HP_SMEAR2 (x) | HP_SMEAR2 (x) >> 4)
+#define HP_SMEAR8(x)	(HP_SMEAR4 (x) | HP_SMEAR4 (x) >> 8)
+#define HP_HIST_BUF	((HP_SMEAR8 (HP_MAX_HIST) | HP_SMEAR8 (HP_MAX_HIST) >> 16) + 1)
+
+// the threshold counter moves the threshold when it reaches this
+
+#define HP_THETA_COUNT	32
+
+class hp_update : public branch_update {
+public:
+	int output;
+	unsigned int index[HP_TABLES];
+};
+
+// what delayed update keeps of a prediction: the above, and a checkpoint
+// of the history to repair it from
+
+class hp_ahead : public hp_update {
+public:
+	bool conditional;
+	int head;
+	unsigned int fold[HP_TABLES];
+};
+
+// a segment of the history folded down to HP_TABLE_BITS bits.  every
+// branch, one bit enters the segment at its start and one leaves at its
+// end; the register rotates by one and takes both in, so it always holds
+// the XOR of the segment's bits arranged in HP_TABLE_BITS columns
+
+struct folded_segment {
+	unsigned int fold;
+	int start, length;	// the segment is history bits [start, start+length)
+	int outpoint;		// column where the bit leaving the segment lands
+
+	void init (int s, int l) {
+		fold = 0;
+		start = s;
+		length = l;
+		outpoint = l % HP_TABLE_BITS;
+	}
+
+	void update (unsigned int in, unsigned int out) {
+		fold = (fold << 1) | in;
+		fold ^= out << outpoint;
+		fold ^= fold >> HP_TABLE_BITS;
+		fold &= (1 << HP_TABLE_BITS) - 1;
+	}
+};
+
+class HashedPerceptron : public branch_predictor {
+	hp_update u;
+	hp_ahead ahead;
+	branch_info bi;
+	signed char (*W)[1<<HP_TABLE_BITS];	// HP_TABLES tables, from the arena
+	unsigned char hist[HP_HIST_BUF];	// one history bit per byte
+	int head;				// where history bit 0 is in hist
+	folded_segment seg[HP_TABLES];
+	int theta, theta_count;
+
+	// history bit i, 0 being the most recent
+
+	unsigned int history (int i) {
+		return hist[(head + i) & (HP_HIST_BUF - 1)];
+	}
+
+public:
+	HashedPerceptron (void) : head(0), theta_count(0) {
+		W = (signed char (*)[1<<HP_TABLE_BITS]) arena_alloc (HP_TABLES * sizeof (*W), "HashedPerceptron W");
+		memset (W, 0, HP_TABLES * sizeof (*W));
+		memset (hist, 0, sizeof (hist));
+
+		// segment i ends at HP_MIN_HIST * r^(i-1), r chosen so the last
+		// one ends at HP_MAX_HIST.  each segment is at least one bit long
+
+		int start = 0;
+		seg[0].init (0, 0);
+		for (int i=1; i<HP_TABLES; i++) {
+			int end = HP_TABLES == 2 ? HP_MAX_HIST :
+				(int) (HP_MIN_HIST * pow ((double) HP_MAX_HIST / HP_MIN_HIST, (i - 1) / (double) (HP_TABLES - 2)) + 0.5);
+			if (end <= start) end = start + 1;
+			if (end > HP_MAX_HIST) end = HP_MAX_HIST;
+			seg[i].init (start, end - start);
+			start = end;
+		}
+
+		// the threshold suggested for O-GEHL with this many tables
+
+		theta = HP_TABLES;
+	}
+
+	~HashedPerceptron (void) {
+		arena_free (W);
+	}
+
+	void state (state_io & s) {
+		s.piece (W, HP_TABLES * sizeof (*W));
+		s.piece (hist, sizeof (hist));
+		s.piece (&head, sizeof (head));
+		s.piece (seg, sizeof (seg));
+		s.piece (&theta, sizeof (theta));
+		s.piece (&theta_count, sizeof (theta_count));
+	}
+
+	// the per-thread part is the history and its folded segments
+
+	void thread_state (state_io & s) {
+		s.piece (hist, sizeof (hist));
+		s.piece (&head, sizeof (head));
+		s.piece (seg, sizeof (seg));
+	}
+
+	// an unconditional branch changes nothing.  once the same conditional
+	// branch has filled the history, the history and the folds stay put,
+	// so it is settled when the output is right and past the threshold,
+	// which trains nothing
+
+	bool settled (branch_info & b, bool taken, long long int k) {
+		if (!(b.br_flags & BR_CONDITIONAL)) return true;
+		if (k <= HP_MAX_HIST) return false;
+		unsigned int pc = b.address ^ (b.address >> HP_TABLE_BITS);
+		int sum = 0;
+		for (int i=0; i<HP_TABLES; i++)
+			sum += W[i][(pc ^ seg[i].fold ^ (seg[i].fold << 1)) & ((1 << HP_TABLE_BITS) - 1)];
+		return (sum >= 0) == taken && abs (sum) > theta;
+	}
+
+	branch_update *predict (branch_info & b) {
+		bi = b;
+		if (b.br_flags & BR_CONDITIONAL) {
+			unsigned int pc = b.address ^ (b.address >> HP_TABLE_BITS);
+			int sum = 0;
+			for (int i=0; i<HP_TABLES; i++) {
+				unsigned int k = (pc ^ seg[i].fold ^ (seg[i].fold << 1)) & ((1 << HP_TABLE_BITS) - 1);
+				u.index[i] = k;
+				sum += W[i][k];
+			}
+			u.output = sum;
+			u.direction_prediction (sum >= 0);
+			int margin = abs (sum);
+			u.confidence (margin, margin > theta ? CONFIDENCE_HIGH : margin > theta/2 ? CONFIDENCE_MEDIUM : CONFIDENCE_LOW);
+		} else {
+			u.direction_prediction (true);
+			u.confidence (0, CONFIDENCE_HIGH);
+		}
+		u.target_prediction (0);
+		return &u;
+	}
+
+	void update (branch_update *bu, bool taken, unsigned int target) {
+		if (!(bi.br_flags & BR_CONDITIONAL)) return;
+		train ((hp_update *) bu, taken);
+		push (taken);
+	}
+
+	// delayed update; see predictor.h
+
+	unsigned int update_size (void) {
+		return sizeof (hp_ahead);
+	}
+
+	branch_update *predict_ahead (branch_info & b) {
+		predict (b);
+		(hp_update &) ahead = u;
+		ahead.conditional = b.br_flags & BR_CONDITIONAL;
+		if (ahead.conditional) {
+			ahead.head = head;
+			for (int i=0; i<HP_TABLES; i++) ahead.fold[i] = seg[i].fold;
+			push (u.direction_prediction ());
+		}
+		return &ahead;
+	}
+
+	void repair (branch_update *bu, bool taken) {
+		hp_ahead *a = (hp_ahead *) bu;
+		head = a->head;
+		for (int i=0; i<HP_TABLES; i++) seg[i].fold = a->fold[i];
+		push (taken);
+	}
+
+	void retire (branch_update *bu, bool taken, unsigned int target) {
+		hp_ahead *a = (hp_ahead *) bu;
+		if (a->conditional) train (a, taken);
+	}
+
+private:
+	// train the weights h was predicted with on the outcome
+
+	void train (hp_update *h, bool taken) {
+
+		// train on a miss or a weak output, without branches
+
+		bool miss = h->direction_prediction () != taken;
+		bool weak = abs (h->output) <= theta;
+		int d = sign_of (taken) & -(int) (miss | weak);
+		for (int i=0; i<HP_TABLES; i++) {
+			signed char *w = &W[i][h->index[i]];
+			*w = sat_add (*w, d, -127, 127);
+		}
+
+		// tune the threshold, as in piecewise.h
+
+		int count = theta_count + (int) miss - (int) (weak & !miss);
+		int up = count >= HP_THETA_COUNT, down = count <= -HP_THETA_COUNT;
+		theta = sat_add (theta, up - down, 1, 255);
+		theta_count = count & -(int) !(up | down);
+	}
+
+	// shift the outcome into the history.  after the shift, the bit at
+	// a segment's start is the one entering it and the bit just past its
+	// end is the one leaving it
+
+	void push (bool taken) {
+		head = (head - 1) & (HP_HIST_BUF - 1);
+		hist[head] = taken;
+		for (int i=1; i<HP_TABLES; i++)
+			seg[i].update (history (seg[i].start), history (seg[i].start + seg[i].length));
+	}
+};
@@ -0,0 +1,141 @@
+// libpredict.cc
+// This file contains the C interface to the predictors declared in
+// libpredict.h.  Only the functions declared there are exported from the
+// shared library; it is built with hidden visibility for everything else.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "branch.h"
+#include "arena.h"
+#include "predictor.h"
+#include "saturate.h"
+#include "my_predictor.h"
+#include "piecewise.h"
+#include "hashed_perceptron.h"
+#include "loop_predictor.h"
+#include "libpredict.h"
+
+#define EXPORT	__attribute__ ((visibility ("default")))
+
+#if BP_CONDITIONAL != BR_CONDITIONAL || BP_INDIRECT != BR_INDIRECT || BP_CALL != BR_CALL || BP_RETURN != BR_RETURN
+#error "the BP_ flags must be the BR_ flags"
+#endif
+
+// a saved state starts with this, so it can't be loaded into a predictor
+// of another kind or size
+
+struct saved_header {
+	unsigned long long int magic;
+	int kind;
+	unsigned long long int size;	// of the state after the header
+};
+
+#define SAVED_MAGIC	0x3165746174737062ULL	// "bpstate1"
+
+struct bp_predictor {
+	branch_predictor *p;
+	int kind;
+	bp_stats stats;
+};
+
+EXPORT bp_predictor *bp_create (enum bp_kind kind) {
+	branch_predictor *p;
+
+	switch (kind) {
+	case BP_GSHARE: p = new my_predictor (); break;
+	case BP_PIECEWISE: p = new Piecewise (); break;
+	case BP_HASHED_PERCEPTRON: p = new HashedPerceptron (); break;
+	case BP_LOOP: p = new LoopPredictor (); break;
+	case BP_PIECEWISE_LOOP: p = new LoopOverride (new Piecewise ()); break;
+	case BP_HASHED_PERCEPTRON_LOOP: p = new LoopOverride (new HashedPerceptron ()); break;
+	default: return NULL;
+	}
+	bp_predictor *b = new bp_predictor;
+	b->p = p;
+	b->kind = kind;
+	memset (&b->stats, 0, sizeof (b->stats));
+	return b;
+}
+
+EXPORT void bp_destroy (bp_predictor *b) {
+	if (!b) return;
+	delete b->p;
+	delete b;
+}
+
+EXPORT size_t bp_predict_update (bp_predictor *b, const bp_record *records, size_t n, size_t stride, uint8_t *predictions) {
+	const char *r = (const char *) records;
+	branch_predictor *p = b->p;
+	size_t conditional = 0, misses = 0;
+
+	if (!stride) stride = sizeof (bp_record);
+	for (size_t i=0; i<n; i++, r+=stride) {
+		const bp_record *rec = (const bp_record *) r;
+		branch_info bi;
+		bi.address = rec->address;
+		bi.opcode = rec->opcode;
+		bi.br_flags = rec->flags;
+		bool taken = rec->taken;
+		bool d = p->predict_and_update (bi, taken, rec->target)->direction_prediction ();
+		if (predictions) predictions[i] = d;
+		bool c = bi.br_flags & BR_CONDITIONAL;
+		conditional += c;
+		misses += c & (d != taken);
+	}
+	b->stats.branches += n;
+	b->stats.conditional += conditional;
+	b->stats.misses += misses;
+	return misses;
+}
+
+EXPORT void bp_get_stats (const bp_predictor *b, bp_stats *stats) {
+	*stats = b->stats;
+}
+
+EXPORT void bp_reset_stats (bp_predictor *b) {
+	memset (&b->stats, 0, sizeof (b->stats));
+}
+
+EXPORT size_t bp_state_size (bp_predictor *b) {
+	state_io s (NULL, 0, false);
+	b->p->state (s);
+	return sizeof (saved_header) + s.pos;
+}
+
+EXPORT size_t bp_save (bp_predictor *b, void *buf, size_t len) {
+	size_t size = bp_state_size (b);
+	if (len < size) return 0;
+	saved_header h;
+	memset (&h, 0, sizeof (h));
+	h.magic = SAVED_MAGIC;
+	h.kind = b->kind;
+	h.size = size - sizeof (h);
+	memcpy (buf, &h, sizeof (h));
+	state_io s ((char *) buf + sizeof (h), h.size, false);
+	b->p->state (s);
+	return size;
+}
+
+EXPORT int bp_load (bp_predictor *b, const void *buf, size_t len) {
+	size_t size = bp_state_size (b);
+	saved_header h;
+	if (len != size) return -1;
+	memcpy (&h, buf, sizeof (h));
+	if (h.magic != SAVED_MAGIC || h.kind != b->kind || h.size != size - sizeof (h)) return -1;
+	state_io s ((char *) buf + sizeof (h), h.size, true);
+	b->p->state (s);
+	return 0;
+}
+
+#define STRING(x)	#x
+#define EXPAND(x)	STRING(x)
+
+EXPORT const char *bp_config (void) {
+	return "M=" EXPAND(M) " N=" EXPAND(N) " H=" EXPAND(H) " THETA=" EXPAND(THETA)
+		" ADAPT_THETA=" EXPAND(ADAPT_THETA) " PW_INDEX=" EXPAND(PW_INDEX)
+		" HP_TABLES=" EXPAND(HP_TABLES) " HP_TABLE_BITS=" EXPAND(HP_TABLE_BITS)
+		" HP_MIN_HIST=" EXPAND(HP_MIN_HIST) " HP_MAX_HIST=" EXPAND(HP_MAX_HIST);
+}
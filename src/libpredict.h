@@ -0,0 +1,103 @@
+/* libpredict.h
+ * This file declares libpredict, the predictors of this simulator as a
+ * library with a C interface for use inside other simulators.  The
+ * predictors' own headers define configuration macros (M, N, H, THETA and
+ * so on) and virtual C++ classes; those stay inside the library, which is
+ * built with one configuration of each, and this header only declares the
+ * names below, all starting with bp_ or BP_.
+ *
+ * Branches are given in batches as caller-owned arrays of records.  A
+ * record may be the start of a bigger struct of the caller's: the stride
+ * gives the distance between records, so a long trace in the caller's own
+ * format is read where it is, without copying.  Nothing is allocated per
+ * branch or per batch; a predictor's tables are allocated once by
+ * bp_create.  A predictor handle must only be used by one thread at a
+ * time; different handles are independent.
+ *
+ * Build with "make lib" in src for libpredict.a and libpredict.so.  The
+ * library is C++ inside, so a C program linking libpredict.a also needs
+ * -lstdc++ -lpthread -lm.  Only the bp_ functions are global in either.
+ */
+
+#ifndef LIBPREDICT_H
+#define LIBPREDICT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the predictors */
+
+enum bp_kind {
+	BP_GSHARE,			/* the sample gshare in my_predictor.h */
+	BP_PIECEWISE,			/* piecewise linear, piecewise.h */
+	BP_HASHED_PERCEPTRON,		/* hashed_perceptron.h */
+	BP_LOOP,			/* loop and local history, loop_predictor.h */
+	BP_PIECEWISE_LOOP,		/* piecewise linear with loop override */
+	BP_HASHED_PERCEPTRON_LOOP	/* hashed perceptron with loop override */
+};
+
+/* the kinds of branch, ORed together in a record's flags */
+
+#define BP_CONDITIONAL	1
+#define BP_INDIRECT	2
+#define BP_CALL		4
+#define BP_RETURN	8
+
+/* one branch and its outcome */
+
+typedef struct bp_record {
+	uint32_t address;	/* of the branch */
+	uint32_t target;	/* where it went */
+	uint8_t flags;		/* BP_ flags */
+	uint8_t opcode;		/* x86 condition code of a conditional branch, 0-15 */
+	uint8_t taken;		/* 1 if it was taken */
+	uint8_t reserved;
+} bp_record;
+
+/* totals since the predictor was created or its stats were reset */
+
+typedef struct bp_stats {
+	uint64_t branches;		/* of all kinds */
+	uint64_t conditional;		/* conditional branches */
+	uint64_t misses;		/* mispredicted conditional branches */
+} bp_stats;
+
+typedef struct bp_predictor bp_predictor;
+
+/* make a predictor, or return NULL for an unknown kind */
+
+bp_predictor *bp_create (enum bp_kind kind);
+void bp_destroy (bp_predictor *p);
+
+/* predict each of the n records starting at records, stride bytes apart
+ * (0 means sizeof (bp_record)), and train on its outcome.  if predictions
+ * isn't NULL, the predicted direction of record i goes in predictions[i].
+ * return the number of conditional branches mispredicted */
+
+size_t bp_predict_update (bp_predictor *p, const bp_record *records, size_t n, size_t stride, uint8_t *predictions);
+
+void bp_get_stats (const bp_predictor *p, bp_stats *stats);
+void bp_reset_stats (bp_predictor *p);
+
+/* the predictor's whole state is bp_state_size bytes.  bp_save writes it
+ * to buf and returns its size, or returns 0 if len is too small.  bp_load
+ * restores a state saved from a predictor of the same kind built from the
+ * same library, returning 0, or returns -1 and leaves p alone if it can't */
+
+size_t bp_state_size (bp_predictor *p);
+size_t bp_save (bp_predictor *p, void *buf, size_t len);
+int bp_load (bp_predictor *p, const void *buf, size_t len);
+
+/* the configuration the library's predictors were built with */
+
+const char *bp_config (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBPREDICT_H */
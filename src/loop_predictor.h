@@ -0,0 +1,321 @@
+// loop_predictor.h
+// This file contains a loop predictor and a local-history predictor.  A
+// loop's exit branch goes the same way for a fixed number of iterations
+// and then the other way once, which a global-history predictor only gets
+// right when the whole trip fits in its history.  The loop table learns
+// the trip count of such a branch and predicts the exit when the count
+// comes up, once it has seen the same count a few times in a row.
+//
+// LoopPredictor runs alone: the loop table where it is confident and a
+// two-level local-history predictor (per-branch histories indexing a table
+// of counters) everywhere else.  LoopOverride wraps any other predictor and
+// lets the loop table override it; build with -DLOOP_OVERRIDE=1 to wrap
+// PREDICTOR in predict.cc.
+//
+// The loop table is LOOP_SETS sets of LOOP_WAYS entries.  So that looking
+// a branch up costs one tag compare, a hint table indexed by the low
+// address bits remembers the way each branch was last put in; a branch
+// with no hint isn't in the table and costs none.
+// ****************************************************************
+// Variables that take up space: the loop entries, the hints, and the
+// local histories and counters.
+// A loop entry is a 14-bit tag, 14-bit trip and iteration counts, a 2-bit
+// confidence, an 8-bit age and a direction bit: 53 bits.
+// A hint is 2 bits, since LOOP_WAYS is 4.
+// A local history is LOCAL_HISTORY bits and a counter 2 bits.
+// ****************************************************************
+// Space: 256 entries * 53 bits + 1024 hints * 2 bits + 1024 histories
+// * 10 bits + 4096 counters * 2 bits = 34,048 bits = 4256 bytes;
+// LoopOverride only has the first two, 1952 bytes.
+
+#define LOOP_SETS	64
+#define LOOP_WAYS	4
+#define LOOP_HINTS	1024
+#define LOOP_TAG_BITS	14
+#define LOOP_COUNT_MAX	((1<<14)-1)
+#define LOOP_CONFIDENT	3	// confidence at which the entry is used
+#define LOOP_AGE_MAX	255
+#define LOCAL_ENTRIES	1024
+#define LOCAL_HISTORY	10
+#define LOCAL_COUNTER_BITS	12
+
+struct loop_entry {
+	unsigned short int tag;
+	unsigned short int trip;	// iterations seen last time; 0 if not known
+	unsigned short int iter;	// iterations so far this time
+	unsigned char confidence;	// times in a row the trip was the same
+	unsigned char age;		// replaceable at 0
+	bool dir;			// the direction that stays in the loop
+};
+
+class loop_update : public branch_update {
+public:
+	int entry;		// in the loop table, or -1 if the branch missed
+	bool loop_direction;	// what the loop table predicts
+	bool loop_valid;	// whether that prediction is used
+	unsigned int local_index;
+	branch_update *base;	// LoopOverride's base predictor's update
+};
+
+// the loop table itself, shared by the two predictors
+
+class loop_table {
+	loop_entry *table;	// LOOP_SETS * LOOP_WAYS entries, from the arena
+	unsigned char *hint;	// LOOP_HINTS ways plus one; 0 for none
+
+	static unsigned int set_of (unsigned int address) {
+		return address & (LOOP_SETS - 1);
+	}
+
+	static unsigned int tag_of (unsigned int address) {
+		return (address / LOOP_SETS) & ((1<<LOOP_TAG_BITS) - 1);
+	}
+
+	void free_entry (loop_entry *e) {
+		e->trip = 0;
+		e->confidence = 0;
+		e->age = 0;
+	}
+
+public:
+	loop_table (void) {
+		table = (loop_entry *) arena_alloc (LOOP_SETS * LOOP_WAYS * sizeof (loop_entry), "loop entries");
+		hint = (unsigned char *) arena_alloc (LOOP_HINTS, "loop hints");
+		memset (table, 0, LOOP_SETS * LOOP_WAYS * sizeof (loop_entry));
+		memset (hint, 0, LOOP_HINTS);
+	}
+
+	~loop_table (void) {
+		arena_free (table);
+		arena_free (hint);
+	}
+
+	void state (state_io & s) {
+		s.piece (table, LOOP_SETS * LOOP_WAYS * sizeof (loop_entry));
+		s.piece (hint, LOOP_HINTS);
+	}
+
+	// look up the branch at address, filling in u's loop fields
+
+	void lookup (unsigned int address, loop_update *u) {
+		u->entry = -1;
+		u->loop_valid = false;
+		u->loop_direction = false;
+		int way = hint[address & (LOOP_HINTS - 1)] - 1;
+		if (way < 0) return;
+		int i = set_of (address) * LOOP_WAYS + way;
+		loop_entry *e = &table[i];
+		if (e->tag != tag_of (address)) return;
+		u->entry = i;
+		u->loop_direction = e->iter + 1 == e->trip ? !e->dir : e->dir;
+		u->loop_valid = e->confidence == LOOP_CONFIDENT;
+	}
+
+	// train on the outcome of the branch at address that u looked up.
+	// other_miss says whether the prediction the loop table would override
+	// was wrong; a branch that isn't in the table gets an entry only then
+
+	void update (unsigned int address, loop_update *u, bool taken, bool other_miss) {
+		if (u->entry < 0) {
+			if (other_miss) allocate (address, taken);
+			return;
+		}
+		loop_entry *e = &table[u->entry];
+
+		// a wrong prediction from a confident entry means it isn't a loop
+		// with a fixed trip after all
+
+		if (u->loop_valid && u->loop_direction != taken) {
+			free_entry (e);
+			return;
+		}
+
+		// an entry that keeps fixing the other predictor stays longer
+
+		if (u->loop_valid && other_miss && e->age < LOOP_AGE_MAX) e->age++;
+
+		e->iter++;
+		if (e->iter > LOOP_COUNT_MAX || (e->trip && e->iter > e->trip)) {
+			// more iterations than last time, or than the counter holds
+
+			free_entry (e);
+			e->iter = 0;
+			return;
+		}
+		if (taken != e->dir) {
+			// the loop exited
+
+			if (e->iter == e->trip) {
+				if (e->confidence < LOOP_CONFIDENT) e->confidence++;
+
+				// loops of one or two iterations are left to the
+				// other predictor
+
+				if (e->trip < 3) free_entry (e);
+			} else if (e->trip == 0) {
+				// the first full trip
+
+				e->trip = e->iter;
+				e->confidence = 0;
+			} else {
+				free_entry (e);
+			}
+			e->iter = 0;
+		}
+	}
+
+	// find a replaceable way in address's set for it, aging the others.
+	// taken is the direction that was mispredicted, taken to be the exit
+
+	void allocate (unsigned int address, bool taken) {
+		loop_entry *set = &table[set_of (address) * LOOP_WAYS];
+		for (int w=0; w<LOOP_WAYS; w++) {
+			loop_entry *e = &set[w];
+			if (e->age == 0) {
+				e->tag = tag_of (address);
+				e->trip = 0;
+				e->iter = 0;
+				e->confidence = 0;
+				e->age = LOOP_AGE_MAX;
+				e->dir = !taken;
+				hint[address & (LOOP_HINTS - 1)] = w + 1;
+				return;
+			}
+			e->age--;
+		}
+	}
+};
+
+// the loop table over a two-level local-history predictor
+
+class LoopPredictor : public branch_predictor {
+	loop_update u;
+	branch_info bi;
+	loop_table loops;
+	unsigned short int *history;	// LOCAL_ENTRIES histories, from the arena
+	unsigned char *counters;	// 1<<LOCAL_COUNTER_BITS counters, from the arena
+
+public:
+	LoopPredictor (void) {
+		history = (unsigned short int *) arena_alloc (LOCAL_ENTRIES * sizeof (unsigned short int), "local histories");
+		counters = (unsigned char *) arena_alloc (1<<LOCAL_COUNTER_BITS, "local counters");
+		memset (history, 0, LOCAL_ENTRIES * sizeof (unsigned short int));
+		memset (counters, 1, 1<<LOCAL_COUNTER_BITS);
+	}
+
+	~LoopPredictor (void) {
+		arena_free (history);
+		arena_free (counters);
+	}
+
+	void state (state_io & s) {
+		loops.state (s);
+		s.piece (history, LOCAL_ENTRIES * sizeof (unsigned short int));
+		s.piece (counters, 1<<LOCAL_COUNTER_BITS);
+	}
+
+	branch_update *predict (branch_info & b) {
+		bi = b;
+		if (b.br_flags & BR_CONDITIONAL) {
+			unsigned int h = history[b.address & (LOCAL_ENTRIES - 1)];
+			u.local_index = (h ^ (b.address << LOCAL_HISTORY)) & ((1<<LOCAL_COUNTER_BITS) - 1);
+			unsigned char c = counters[u.local_index];
+			loops.lookup (b.address, &u);
+			if (u.loop_valid) {
+				u.direction_prediction (u.loop_direction);
+				u.confidence (LOOP_CONFIDENT, CONFIDENCE_HIGH);
+			} else {
+				bool strong = c == 0 || c == 3;
+				u.direction_prediction (c >> 1);
+				u.confidence (strong, strong ? CONFIDENCE_HIGH : CONFIDENCE_LOW);
+			}
+		} else {
+			u.direction_prediction (true);
+			u.confidence (0, CONFIDENCE_HIGH);
+		}
+		u.target_prediction (0);
+		return &u;
+	}
+
+	void update (branch_update *bu, bool taken, unsigned int target) {
+		if (!(bi.br_flags & BR_CONDITIONAL)) return;
+		loop_update *l = (loop_update *) bu;
+		unsigned char *c = &counters[l->local_index];
+		loops.update (bi.address, l, taken, (*c >> 1) != taken);
+		*c = sat_add (*c, sign_of (taken), 0, 3);
+		unsigned short int *h = &history[bi.address & (LOCAL_ENTRIES - 1)];
+		*h = ((*h << 1) | taken) & ((1<<LOCAL_HISTORY) - 1);
+	}
+};
+
+// the loop table overriding another predictor, which it owns
+
+class LoopOverride : public branch_predictor {
+	loop_update u;
+	branch_info bi;
+	loop_table loops;
+	branch_predictor *base;
+
+	// give u the base predictor's prediction unless the loop table
+	// is sure of its own
+
+	void combine (branch_update *b) {
+		u.base = b;
+		u.target_prediction (b->target_prediction ());
+		if (u.loop_valid) {
+			u.direction_prediction (u.loop_direction);
+			u.confidence (LOOP_CONFIDENT, CONFIDENCE_HIGH);
+		} else {
+			u.direction_prediction (b->direction_prediction ());
+			u.confidence (b->confidence (), b->confidence_class ());
+		}
+	}
+
+public:
+	LoopOverride (branch_predictor *p) : base(p) {}
+
+	~LoopOverride (void) {
+		delete base;
+	}
+
+	void state (state_io & s) {
+		loops.state (s);
+		base->state (s);
+	}
+
+	// the loop table is shared like the base predictor's tables
+
+	void thread_state (state_io & s) {
+		base->thread_state (s);
+	}
+
+	branch_update *predict (branch_info & b) {
+		bi = b;
+		u.entry = -1;
+		u.loop_valid = false;
+		if (b.br_flags & BR_CONDITIONAL) loops.lookup (b.address, &u);
+		combine (base->predict (b));
+		return &u;
+	}
+
+	void update (branch_update *bu, bool taken, unsigned int target) {
+		loop_update *l = (loop_update *) bu;
+		if (bi.br_flags & BR_CONDITIONAL)
+			loops.update (bi.address, l, taken, l->base->direction_prediction () != taken);
+		base->update (l->base, taken, target);
+	}
+
+	// keep the base predictor's fused path; the loop table's decision
+	// doesn't depend on how the base trains
+
+	branch_update *predict_and_update (branch_info & b, bool taken, unsigned int target) {
+		bi = b;
+		u.entry = -1;
+		u.loop_valid = false;
+		if (b.br_flags & BR_CONDITIONAL) loops.lookup (b.address, &u);
+		combine (base->predict_and_update (b, taken, target));
+		if (b.br_flags & BR_CONDITIONAL)
+			loops.update (b.address, &u, taken, u.base->direction_prediction () != taken);
+		return &u;
+	}
+};
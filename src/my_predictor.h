@@ -7,6 +7,8 @@
 class my_update : public branch_update {
 public:
 	unsigned int index;
+	bool conditional;	// for delayed update
+	unsigned int history;	// the history before the branch, for repair
 };
 
 class my_predictor : public branch_predictor {
@@ -16,10 +18,15 @@ public:
 	my_update u;
 	branch_info bi;
 	unsigned int history;
-	unsigned char tab[1<<TABLE_BITS];
+	unsigned char *tab;	// 1<<TABLE_BITS counters, from the arena
 
 	my_predictor (void) : history(0) { 
-		memset (tab, 0, sizeof (tab));
+		tab = (unsigned char *) arena_alloc (1<<TABLE_BITS, "gshare counters");
+		memset (tab, 0, 1<<TABLE_BITS);
+	}
+
+	~my_predictor (void) {
+		arena_free (tab);
 	}
 
 	branch_update *predict (branch_info & b) {
@@ -29,6 +36,11 @@ public:
 				  (history << (TABLE_BITS - HISTORY_LENGTH)) 
 				^ (b.address & ((1<<TABLE_BITS)-1));
 			u.direction_prediction (tab[u.index] >> 1);
+
+			// the hysteresis bit: 0 and 3 are strong, 1 and 2 weak
+
+			bool strong = tab[u.index] == 0 || tab[u.index] == 3;
+			u.confidence (strong, strong ? CONFIDENCE_HIGH : CONFIDENCE_LOW);
 		} else {
 			u.direction_prediction (true);
 		}
@@ -36,17 +48,61 @@ public:
 		return &u;
 	}
 
+	void state (state_io & s) {
+		s.piece (tab, 1<<TABLE_BITS);
+		s.piece (&history, sizeof (history));
+	}
+
+	void thread_state (state_io & s) {
+		s.piece (&history, sizeof (history));
+	}
+
+	// an unconditional branch changes nothing.  a conditional one
+	// settles once the history is full of its outcome and its counter
+	// is saturated that way
+
+	bool settled (branch_info & b, bool taken, long long int k) {
+		if (!(b.br_flags & BR_CONDITIONAL)) return true;
+		if (k < HISTORY_LENGTH) return false;
+		unsigned int index = 
+			  (history << (TABLE_BITS - HISTORY_LENGTH)) 
+			^ (b.address & ((1<<TABLE_BITS)-1));
+		return tab[index] == (taken ? 3 : 0);
+	}
+
 	void update (branch_update *u, bool taken, unsigned int target) {
 		if (bi.br_flags & BR_CONDITIONAL) {
 			unsigned char *c = &tab[((my_update*)u)->index];
-			if (taken) {
-				if (*c < 3) (*c)++;
-			} else {
-				if (*c > 0) (*c)--;
-			}
+			*c = sat_add (*c, sign_of (taken), 0, 3);
 			history <<= 1;
 			history |= taken;
 			history &= (1<<HISTORY_LENGTH)-1;
 		}
 	}
+
+	// delayed update: the counter's index and the history before the
+	// branch are all there is to keep
+
+	unsigned int update_size (void) {
+		return sizeof (my_update);
+	}
+
+	branch_update *predict_ahead (branch_info & b) {
+		predict (b);
+		u.conditional = b.br_flags & BR_CONDITIONAL;
+		u.history = history;
+		if (u.conditional) repair (&u, u.direction_prediction ());
+		return &u;
+	}
+
+	void repair (branch_update *bu, bool taken) {
+		history = ((((my_update *) bu)->history << 1) | taken) & ((1<<HISTORY_LENGTH)-1);
+	}
+
+	void retire (branch_update *bu, bool taken, unsigned int target) {
+		my_update *m = (my_update *) bu;
+		if (!m->conditional) return;
+		unsigned char *c = &tab[m->index];
+		*c = sat_add (*c, sign_of (taken), 0, 3);
+	}
 };
\ No newline at end of file
@@ -0,0 +1,286 @@
+// perf.cc
+// This file contains the instrumentation layer declared in perf.h.  Each
+// counter is opened with perf_event_open for this thread in user mode only.
+// When the kernel lets us, counters are read with the rdpmc instruction
+// through the mmap'ed control page, which takes a few dozen cycles; otherwise
+// they are read with read(2), which is much slower and inflates the counts of
+// whatever phase is being measured, so expect the totals to be a little high
+// either way.  If no counter can be opened at all, perf_mark only keeps time.
+//
+// When there are more events than hardware counters, or another profiler
+// holds some, the kernel multiplexes them and an event only counts part of
+// the time.  Each reading comes with how long the event has been enabled
+// and how long it has actually been counting, and the count for each
+// interval between marks is scaled up by the ratio, as perf stat does.
+// print_perf says which events that happened to.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf.h"
+
+static const char *phase_names[PERF_NPHASES] = { "decode", "predict", "update" };
+static const char *counter_names[PERF_NCOUNTERS] =
+	{ "cycles", "instructions", "L1D misses", "branch misses" };
+
+// one open counter
+
+struct perf_counter {
+	int fd;					// -1 if it couldn't be opened
+	struct perf_event_mmap_page *page;	// for rdpmc; NULL if unavailable
+};
+
+static perf_counter counters[PERF_NCOUNTERS];
+
+// a counter's value and the nanoseconds it has been enabled and running
+
+struct perf_reading {
+	unsigned long long int count, enabled, running;
+};
+
+// true when at least one hardware counter is open
+
+static bool have_counters;
+
+// totals charged to each phase, plus the number of times it was entered
+
+static unsigned long long int totals[PERF_NPHASES][PERF_NCOUNTERS];
+static unsigned long long int nsecs[PERF_NPHASES];
+static unsigned long long int entries[PERF_NPHASES];
+
+// how long each counter was enabled and running while a phase was, so
+// multiplexing can be reported
+
+static unsigned long long int enabled_total[PERF_NCOUNTERS], running_total[PERF_NCOUNTERS];
+
+// the readings at the last mark and the phase it started
+
+static perf_reading last[PERF_NCOUNTERS];
+static unsigned long long int last_nsec;
+static int cur_phase = PERF_IDLE;
+
+static int perf_event_open (struct perf_event_attr *attr) {
+	return syscall (SYS_perf_event_open, attr, 0, -1, -1, 0);
+}
+
+// open one counter and try to map its control page
+
+static void open_counter (perf_counter *c, unsigned int type, unsigned long long int config) {
+	struct perf_event_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.size = sizeof (attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	c->page = NULL;
+	c->fd = perf_event_open (&attr);
+	if (c->fd < 0) return;
+	void *p = mmap (NULL, sysconf (_SC_PAGESIZE), PROT_READ, MAP_SHARED, c->fd, 0);
+	if (p != MAP_FAILED) {
+		c->page = (struct perf_event_mmap_page *) p;
+		if (!c->page->cap_user_rdpmc) {
+			munmap (p, sysconf (_SC_PAGESIZE));
+			c->page = NULL;
+		}
+	}
+	have_counters = true;
+}
+
+// read a counter the slow way
+
+static void read_counter_syscall (perf_counter *c, perf_reading *r) {
+	if (read (c->fd, r, sizeof (*r)) != sizeof (*r)) memset (r, 0, sizeof (*r));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline unsigned long long int rdpmc (unsigned int i) {
+	unsigned int lo, hi;
+	__asm__ __volatile__ ("rdpmc" : "=a" (lo), "=d" (hi) : "c" (i));
+	return lo | ((unsigned long long int) hi << 32);
+}
+
+static inline unsigned long long int rdtsc (void) {
+	unsigned int lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return lo | ((unsigned long long int) hi << 32);
+}
+#endif
+
+// read a counter, from user space if we can
+
+static inline void read_counter (perf_counter *c, perf_reading *r) {
+	if (c->fd < 0) {
+		memset (r, 0, sizeof (*r));
+		return;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	if (c->page) {
+		struct perf_event_mmap_page *pc = c->page;
+		unsigned int seq, idx;
+		long long int count;
+		unsigned long long int enabled, running, delta = 0;
+		do {
+			seq = pc->lock;
+			__asm__ __volatile__ ("" ::: "memory");
+			enabled = pc->time_enabled;
+			running = pc->time_running;
+
+			// the times are as of when the event was last scheduled;
+			// the time since then comes from the TSC
+
+			if (pc->cap_user_time) {
+				unsigned long long int cyc = rdtsc ();
+				unsigned long long int quot = cyc >> pc->time_shift;
+				unsigned long long int rem = cyc & (((unsigned long long int) 1 << pc->time_shift) - 1);
+				delta = pc->time_offset + quot * pc->time_mult + ((rem * pc->time_mult) >> pc->time_shift);
+			}
+			idx = pc->index;
+			count = pc->offset;
+			if (idx) {
+				// sign extend the raw counter to 64 bits
+
+				int shift = 64 - pc->pmc_width;
+				long long int pmc = rdpmc (idx - 1);
+				count += (pmc << shift) >> shift;
+			}
+			__asm__ __volatile__ ("" ::: "memory");
+		} while (pc->lock != seq);
+
+		// an index of 0 means the counter isn't on the hardware
+
+		if (idx) {
+			r->count = count;
+			r->enabled = enabled + delta;
+			r->running = running + delta;
+			return;
+		}
+	}
+#endif
+	read_counter_syscall (c, r);
+}
+
+// the count between two readings, scaled up to the whole time the counter
+// was enabled if it only ran for part of it
+
+static unsigned long long int scaled_count (perf_reading *from, perf_reading *to) {
+	unsigned long long int count = to->count - from->count;
+	unsigned long long int enabled = to->enabled - from->enabled, running = to->running - from->running;
+
+	if (running >= enabled) return count;
+	if (running == 0) return 0;
+	return (unsigned long long int) ((double) count * enabled / running);
+}
+
+static inline unsigned long long int now_nsec (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// open the counters; return true if there are any hardware counters
+
+bool init_perf (void) {
+	have_counters = false;
+	open_counter (&counters[PERF_CYCLES], PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	open_counter (&counters[PERF_INSTRUCTIONS], PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	open_counter (&counters[PERF_L1D_MISSES], PERF_TYPE_HW_CACHE,
+		PERF_COUNT_HW_CACHE_L1D
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	open_counter (&counters[PERF_BRANCH_MISSES], PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	memset (totals, 0, sizeof (totals));
+	memset (enabled_total, 0, sizeof (enabled_total));
+	memset (running_total, 0, sizeof (running_total));
+	memset (nsecs, 0, sizeof (nsecs));
+	memset (entries, 0, sizeof (entries));
+	cur_phase = PERF_IDLE;
+	return have_counters;
+}
+
+// charge everything since the last mark to the running phase and start
+// the given phase
+
+void perf_mark (int phase) {
+	perf_reading v[PERF_NCOUNTERS];
+	unsigned long long int t;
+
+	if (have_counters)
+		for (int i=0; i<PERF_NCOUNTERS; i++) read_counter (&counters[i], &v[i]);
+	t = now_nsec ();
+	if (cur_phase != PERF_IDLE) {
+		if (have_counters)
+			for (int i=0; i<PERF_NCOUNTERS; i++) {
+				totals[cur_phase][i] += scaled_count (&last[i], &v[i]);
+				enabled_total[i] += v[i].enabled - last[i].enabled;
+				running_total[i] += v[i].running - last[i].running;
+			}
+		nsecs[cur_phase] += t - last_nsec;
+	}
+	if (phase != PERF_IDLE) entries[phase]++;
+	if (have_counters)
+		for (int i=0; i<PERF_NCOUNTERS; i++) last[i] = v[i];
+	last_nsec = t;
+	cur_phase = phase;
+}
+
+// copy out the counter totals and nanoseconds charged to a phase.  return
+// false if only time was measured, leaving the counter totals zero
+
+bool perf_totals (int phase, unsigned long long int *counts, unsigned long long int *nsec) {
+	for (int i=0; i<PERF_NCOUNTERS; i++) counts[i] = totals[phase][i];
+	*nsec = nsecs[phase];
+	return have_counters;
+}
+
+// print the totals for each phase
+
+void print_perf (FILE *f, const char *name) {
+	fprintf (f, "perf: %s\n", name);
+	fprintf (f, "%-8s %12s %8s", "phase", "calls", "ns/call");
+	if (have_counters) {
+		for (int i=0; i<PERF_NCOUNTERS; i++)
+			if (counters[i].fd >= 0) fprintf (f, " %15s", counter_names[i]);
+		fprintf (f, " %6s", "IPC");
+	}
+	fprintf (f, "\n");
+	for (int p=0; p<PERF_NPHASES; p++) {
+		double n = entries[p] ? entries[p] : 1;
+		fprintf (f, "%-8s %12llu %8.2f", phase_names[p], entries[p], nsecs[p] / n);
+		if (have_counters) {
+			for (int i=0; i<PERF_NCOUNTERS; i++)
+				if (counters[i].fd >= 0) fprintf (f, " %15llu", totals[p][i]);
+			if (totals[p][PERF_CYCLES])
+				fprintf (f, " %6.2f", totals[p][PERF_INSTRUCTIONS] / (double) totals[p][PERF_CYCLES]);
+			else
+				fprintf (f, " %6s", "-");
+		}
+		fprintf (f, "\n");
+	}
+	if (!have_counters)
+		fprintf (f, "(no hardware counters; check /proc/sys/kernel/perf_event_paranoid)\n");
+	for (int i=0; i<PERF_NCOUNTERS; i++)
+		if (counters[i].fd >= 0 && running_total[i] < enabled_total[i])
+			fprintf (f, "(%s counted %0.1f%% of the time, shared with other events; scaled up)\n",
+				counter_names[i], 100.0 * running_total[i] / enabled_total[i]);
+}
+
+// close the counters
+
+void end_perf (void) {
+	for (int i=0; i<PERF_NCOUNTERS; i++) {
+		if (counters[i].page) munmap (counters[i].page, sysconf (_SC_PAGESIZE));
+		if (counters[i].fd >= 0) close (counters[i].fd);
+		counters[i].page = NULL;
+		counters[i].fd = -1;
+	}
+	have_counters = false;
+}
@@ -0,0 +1,32 @@
+// perf.h
+// This file declares an optional layer for measuring where the simulator
+// spends its time.  The main loop marks the start of each phase (decoding a
+// trace, predicting it, updating the predictor) and the hardware counters
+// that ran since the previous mark are charged to the phase that was running.
+// The counters come from Linux perf_event_open; without the permissions for
+// that only wall-clock time is collected.
+
+// phases of the main loop
+
+#define PERF_DECODE	0
+#define PERF_PREDICT	1
+#define PERF_UPDATE	2
+#define PERF_NPHASES	3
+
+// pass this to perf_mark to stop charging anything
+
+#define PERF_IDLE	PERF_NPHASES
+
+// counters collected for each phase
+
+#define PERF_CYCLES		0
+#define PERF_INSTRUCTIONS	1
+#define PERF_L1D_MISSES		2
+#define PERF_BRANCH_MISSES	3
+#define PERF_NCOUNTERS		4
+
+bool init_perf (void);
+void perf_mark (int);
+void print_perf (FILE *, const char *);
+bool perf_totals (int, unsigned long long int *, unsigned long long int *);
+void end_perf (void);
@@ -53,11 +53,100 @@ public:
 		return queue[modulo_index];
 	}
 
+	void state(state_io &s) {
+		s.piece(queue, length * sizeof(*queue));
+		s.piece(&front, sizeof(front));
+		s.piece(&back, sizeof(back));
+		s.piece(&_size, sizeof(_size));
+	}
+
 	~AddressQueue() {
 		delete[] queue;
 	}
 };
 
+// The geometry of Piecewise; see the space accounting below the index policies.
+#ifndef M
+#define M 256
+#endif
+#ifndef N
+#define N 1
+#endif
+#ifndef H
+#define H 32
+#endif
+
+// Index policies: how Piecewise picks the row of W for a branch address and
+// the column of W for an address in GA.  The column is computed once, when the
+// address is pushed into GA, and GA keeps that rather than the address; a
+// policy can then still vary it by history position with position(), which
+// is applied on every lookup and so must be cheap.
+// Choose one at build time with -DPW_INDEX=..., default ModIndex.
+// ModIndex:    address % N, address % M. Works for any M and N.
+// MaskIndex:   the low bits of the address. M and N must be powers of two.
+// FoldedIndex: all 32 address bits XOR-folded down to log2 M (or N) bits.
+// SkewedIndex: the row as in FoldedIndex, and a different multiplicative
+//              hash of the address for the column at each history position,
+//              so two paths that alias at one position usually don't alias
+//              at the others.
+
+#define IS_POW2(x) (((x) & ((x) - 1)) == 0)
+#define LOG2(x) ((x) > 1 ? 31 - __builtin_clz(x) : 0)
+
+// XOR the address down to bits bits
+static inline unsigned int fold_address(unsigned int a, int bits) {
+	if (bits == 0) return 0;
+	unsigned int res = 0;
+	for (; a; a >>= bits) res ^= a & ((1u << bits) - 1);
+	return res;
+}
+
+template <int M_, int N_> struct ModIndex {
+	static unsigned int row(unsigned int a) { return a % N_; }
+	static unsigned int column(unsigned int a) { return a % M_; }
+	static unsigned int position(unsigned int col, int i) { return col; }
+};
+
+template <int M_, int N_> struct MaskIndex {
+	static_assert(IS_POW2(M_) && IS_POW2(N_), "MaskIndex needs M and N to be powers of two");
+	static unsigned int row(unsigned int a) { return a & (N_ - 1); }
+	static unsigned int column(unsigned int a) { return a & (M_ - 1); }
+	static unsigned int position(unsigned int col, int i) { return col; }
+};
+
+template <int M_, int N_> struct FoldedIndex {
+	static_assert(IS_POW2(M_) && IS_POW2(N_), "FoldedIndex needs M and N to be powers of two");
+	static unsigned int row(unsigned int a) { return fold_address(a, LOG2(N_)); }
+	static unsigned int column(unsigned int a) { return fold_address(a, LOG2(M_)); }
+	static unsigned int position(unsigned int col, int i) { return col; }
+};
+
+template <int M_, int N_> struct SkewedIndex {
+	static_assert(IS_POW2(M_) && IS_POW2(N_), "SkewedIndex needs M and N to be powers of two");
+	static unsigned int row(unsigned int a) { return fold_address(a, LOG2(N_)); }
+	// keep the whole address, and at each position hash it with a
+	// different odd multiplier, keeping the high bits of the product
+	static unsigned int column(unsigned int a) { return a; }
+	static unsigned int position(unsigned int a, int i) {
+		return LOG2(M_) ? (a * (0x9E3779B1u + 2 * i * 0x85EBCA6Bu)) >> (32 - LOG2(M_)) : 0;
+	}
+};
+
+#ifndef PW_INDEX
+#define PW_INDEX ModIndex
+#endif
+
+// What delayed update keeps of a prediction: the output, where the weights
+// were, and the history before the branch, which is also the checkpoint to
+// repair it from.
+class piece_ahead : public my_update_piece {
+public:
+	unsigned int address;
+	bool conditional;
+	unsigned long long GHR;
+	int n; // the columns in GA
+	unsigned int column[H];
+};
 
 // Branch predictor from paper "Piecewise Linear Branch Prediction"
 // Derived from abstract class branch_predictor
@@ -68,31 +157,105 @@ public:
 // Total space for W is M*N*(H+1) bytes.
 // ****************************************************************
 // GA is a queue(implemented using array) with max length H. 
-// Each element is unsigned which takes 4 bytes. 
+// Each element is unsigned which takes 4 bytes. It holds the W column of
+// each address, as chosen by the index policy, rather than the address.
 // Total 4*H bytes.
 // ****************************************************************
 // Other variables only takes constant space, no need to count them.
 // Space: M*N*(H+1) + 4*H bytes 
+// The geometry can be set at build time, e.g. -DM=2 -DN=128 -DH=32
+// (make predict_2_128_32 does that). H can be at most 63.
+
 class Piecewise : public branch_predictor {
-#define M 256
-#define N 1
-#define H 32
 #define THETA 2.14 * (H+1) + 20.58
 
+// THETA rounded up, so that an integer |output| < THETA_INT exactly when
+// |output| < THETA
+#define THETA_INT ((int) (THETA) + ((int) (THETA) < (THETA)))
+
+// With -DADAPT_THETA the training threshold is no longer fixed: each of
+// THETA_CLASSES classes of branch addresses has its own threshold, starting
+// at THETA_INT, and a counter that goes up on a misprediction and down when
+// a correct prediction is trained only because it was below the threshold.
+// When the counter reaches +THETA_COUNT the threshold goes up by one and
+// when it reaches -THETA_COUNT it goes down by one (the O-GEHL scheme).
+// The threshold then gates the training of every weight, as in the paper,
+// rather than just the bias.  This adds 2*THETA_CLASSES bytes.  Build it
+// with e.g. make CXXFLAGS="-g -O3 -Wall -DADAPT_THETA=1" predict.
+#ifndef ADAPT_THETA
+#define ADAPT_THETA 0
+#endif
+#ifndef THETA_CLASSES
+#define THETA_CLASSES 64
+#endif
+#ifndef THETA_COUNT
+#define THETA_COUNT 8
+#endif
+
+	typedef PW_INDEX<M, N> Index;
+
 private:
-	char W[N][M][H+1];
+	char (*W)[M][H+1]; // N rows, from the arena
+	unsigned char theta[THETA_CLASSES];
+	signed char theta_count[THETA_CLASSES];
 	unsigned long long GHR = 0;
 	AddressQueue GA;
 	my_update_piece u;
+	piece_ahead ahead;
 	branch_info bi;
 
 public:
 	Piecewise(void): GA(H) {
-		memset(W, 0, sizeof(W));
+		W = (char (*)[M][H+1]) arena_alloc(N * sizeof(*W), "Piecewise W");
+		memset(W, 0, N * sizeof(*W));
+		memset(theta, THETA_INT, sizeof(theta));
+		memset(theta_count, 0, sizeof(theta_count));
+	}
+
+	~Piecewise() {
+		arena_free(W);
+	}
+
+	void state(state_io &s) {
+		s.piece(W, N * sizeof(*W));
+		s.piece(theta, sizeof(theta));
+		s.piece(theta_count, sizeof(theta_count));
+		s.piece(&GHR, sizeof(GHR));
+		GA.state(s);
+	}
+
+	// the per-thread part is GHR and GA, about 4*H bytes
+
+	void thread_state(state_io &s) {
+		s.piece(&GHR, sizeof(GHR));
+		GA.state(s);
+	}
+
+	// An unconditional branch changes nothing. After H of the same
+	// conditional branch GHR and GA are full of it and stay that way, so
+	// it is settled once the output is right and past the threshold, which
+	// leaves the bias and theta alone, and every weight that is trained
+	// anyway is saturated the way it would move.
+	bool settled(branch_info &b, bool taken, long long int k) {
+		if (!(b.br_flags & BR_CONDITIONAL)) return true;
+		if (k < H) return false;
+		int address_modn = Index::row(b.address);
+		unsigned long long hist = rotl1(GHR);
+		unsigned long long agree = hist ^ (taken ? 0 : ~0ULL);
+		int res = W[address_modn][0][0];
+		bool saturated = true;
+		int n = GA.size();
+		for (int i = 0; i < n; i++) {
+			char w = W[address_modn][Index::position(GA[i], i)][i];
+			res += select_sign(w, (hist >> i) & 1);
+			saturated &= sat_add(w, sign_of((agree >> i) & 1), -127, 127) == w;
+		}
+		int t = ADAPT_THETA ? theta[b.address % THETA_CLASSES] : THETA_INT;
+		return (res >= 0) == taken && abs(res) >= t && (ADAPT_THETA || saturated);
 	}
 
 	branch_update* predict(branch_info &b) {
-		int address_modn = b.address % N;
+		int address_modn = Index::row(b.address);
 		int res = W[address_modn][0][0];
 
 		bi = b;
@@ -100,16 +263,18 @@ public:
 			// If the branch is conditional, it should be investigated further. 
 			// Otherwise, the branch should always be taken.
 			// The following for loop sums the weights.
+			// Bit i of hist is the history bit paired with weight i.
+			unsigned long long hist = rotl1(GHR);
 			for (int i = 0; i < GA.size(); i++) {
-				int second_index = GA[i] % M;
+				int second_index = Index::position(GA[i], i);
 				char thisweight = W[address_modn][second_index][i];
-				res += (GHR & ((unsigned long long)1 << (i-1)))?(int)thisweight:-(int)thisweight;
+				res += select_sign(thisweight, (hist >> i) & 1);
 			}
-			u.set_output(res);
-			u.direction_prediction(res>=0);
+			set_prediction(res);
 		}
 		else {
 			u.direction_prediction (true);
+			u.confidence(0, CONFIDENCE_HIGH);
 		}
 		u.target_prediction (0);
 		return &u;
@@ -117,29 +282,129 @@ public:
 
 	void update(branch_update* u, bool taken, unsigned int target) {
 		if (!(bi.br_flags & BR_CONDITIONAL)) return;
-		int address_modn = bi.address % N;
-		
-		// update bias
-		if (abs(((my_update_piece*)u)->get_output()) < THETA || taken != u->direction_prediction()) {
-			// using saturating arithmetic
-			if (taken && W[address_modn][0][0] < 127) 
-				W[address_modn][0][0]++;
-			if (!taken && W[address_modn][0][0] > -127) 
-				W[address_modn][0][0]--;
-		}
+		int address_modn = Index::row(bi.address);
+		bool train = train_bias(bi.address, address_modn, this->u, taken);
 		
 		// update weights other than bias
+		// bit i of agree is set when the history bit paired with weight i matches the outcome
+		unsigned long long agree = rotl1(GHR) ^ (taken ? 0 : ~0ULL);
 		for (int i = 0; i < GA.size(); i++) {
-			int second_index = GA[i] % M;
+			int second_index = Index::position(GA[i], i);
 			// using saturating arithmetic
-			if ((((GHR & ((unsigned long long)1 << (i-1))) > 0) == taken) && W[address_modn][second_index][i] < 127) 
-				W[address_modn][second_index][i]++;
-			if (!(((GHR & ((unsigned long long)1 << (i-1))) > 0) == taken) && W[address_modn][second_index][i] > -127) 
-				W[address_modn][second_index][i]--;
+			char *w = &W[address_modn][second_index][i];
+			*w = sat_add(*w, sign_of((agree >> i) & 1) & -(int)(train | !ADAPT_THETA), -127, 127);
 		}
-		
-		// update GA
-		GA.push_back(bi.address);
+		push_history(taken);
+	}
+
+	// Predict and train in one pass when the outcome is already known, with
+	// the same results as predict followed by update. The loop sums each
+	// weight and, since weights other than the bias are trained no matter
+	// what the output is, trains it while it is in hand. Weight 0 can share
+	// a byte with the bias, so it is left for after the bias is trained, and
+	// with ADAPT_THETA the training depends on the output, so the loop only
+	// remembers where the weights are for a second loop.
+	branch_update* predict_and_update(branch_info &b, bool taken, unsigned int target) {
+		if (!(b.br_flags & BR_CONDITIONAL)) return predict(b);
+		bi = b;
+		int address_modn = Index::row(b.address);
+		unsigned long long hist = rotl1(GHR);
+		unsigned long long agree = hist ^ (taken ? 0 : ~0ULL);
+		int n = GA.size();
+		char *w[H];
+		int res = W[address_modn][0][0];
+		for (int i = 0; i < n; i++) {
+			w[i] = &W[address_modn][Index::position(GA[i], i)][i];
+			char thisweight = *w[i];
+			res += select_sign(thisweight, (hist >> i) & 1);
+			if (!ADAPT_THETA && i)
+				*w[i] = sat_add(thisweight, sign_of((agree >> i) & 1), -127, 127);
+		}
+		set_prediction(res);
+		u.target_prediction (0);
+		bool train = train_bias(bi.address, address_modn, u, taken);
+		for (int i = 0; i < (ADAPT_THETA ? n : n > 0); i++)
+			*w[i] = sat_add(*w[i], sign_of((agree >> i) & 1) & -(int)(train | !ADAPT_THETA), -127, 127);
+		push_history(taken);
+		return &u;
+	}
+
+	// Delayed update. GA gets the same column whatever the direction, so
+	// only GHR needs repair.
+	unsigned int update_size() {
+		return sizeof(piece_ahead);
+	}
+
+	branch_update* predict_ahead(branch_info &b) {
+		predict(b);
+		(my_update_piece &) ahead = u;
+		ahead.address = b.address;
+		ahead.conditional = b.br_flags & BR_CONDITIONAL;
+		if (ahead.conditional) {
+			ahead.GHR = GHR;
+			ahead.n = GA.size();
+			for (int i = 0; i < ahead.n; i++) ahead.column[i] = GA[i];
+			push_history(u.direction_prediction());
+		}
+		return &ahead;
+	}
+
+	void repair(branch_update *bu, bool taken) {
+		GHR = ((((piece_ahead *) bu)->GHR << 1) | taken) & (((unsigned long long)1 << H) - 1);
+	}
+
+	// train as update does, on the weights and history the prediction used
+	void retire(branch_update *bu, bool taken, unsigned int target) {
+		piece_ahead *a = (piece_ahead *) bu;
+		if (!a->conditional) return;
+		int address_modn = Index::row(a->address);
+		bool train = train_bias(a->address, address_modn, *a, taken);
+		unsigned long long agree = rotl1(a->GHR) ^ (taken ? 0 : ~0ULL);
+		for (int i = 0; i < a->n; i++) {
+			char *w = &W[address_modn][Index::position(a->column[i], i)][i];
+			*w = sat_add(*w, sign_of((agree >> i) & 1) & -(int)(train | !ADAPT_THETA), -127, 127);
+		}
+	}
+
+private:
+	// set the prediction in u from the output
+	void set_prediction(int res) {
+		u.set_output(res);
+		u.direction_prediction(res>=0);
+
+		// confidence is the margin: outputs past the training threshold are
+		// high confidence, and those under half of it are low
+		int t = ADAPT_THETA ? theta[bi.address % THETA_CLASSES] : THETA_INT;
+		int margin = abs(res);
+		u.confidence(margin, margin >= t ? CONFIDENCE_HIGH : margin >= t/2 ? CONFIDENCE_MEDIUM : CONFIDENCE_LOW);
+	}
+
+	// update the bias for the outcome of the branch at address predicted
+	// with up, and with ADAPT_THETA its threshold; return whether the
+	// prediction needed training
+	bool train_bias(unsigned int address, int address_modn, my_update_piece &up, bool taken) {
+		// update bias, only when the output was weak or wrong
+		// using saturating arithmetic, moving by 0 when no training is needed
+		int c = ADAPT_THETA ? address % THETA_CLASSES : 0;
+		bool weak = abs(up.get_output()) < (ADAPT_THETA ? theta[c] : THETA_INT);
+		bool miss = taken != up.direction_prediction();
+		bool train = weak | miss;
+		W[address_modn][0][0] = sat_add(W[address_modn][0][0], sign_of(taken) & -(int)train, -127, 127);
+
+		// tune this class's threshold, without branches
+		if (ADAPT_THETA) {
+			int count = theta_count[c] + (int)miss - (int)(weak & !miss);
+			int up = count >= THETA_COUNT, down = count <= -THETA_COUNT;
+			theta[c] = sat_add(theta[c], up - down, 1, 255);
+			theta_count[c] = count & -(int)!(up | down);
+		}
+		return train;
+	}
+
+	// shift the outcome of the branch in bi into the histories
+	void push_history(bool taken) {
+		// update GA, with the column for the address rather than the address
+		GA.push_back(Index::column(bi.address));
 		
 		// update GHR
 		GHR <<= 1; // shifting GHR to make up a slot for current "taken"
@@ -1,46 +1,191 @@
 // predict.cc
 // This file contains the main function.  The program accepts a single 
-// parameter: the name of a trace file.  It drives the branch predictor
-// simulation by reading the trace file and feeding the traces one at a time
-// to the branch predictor.
+// parameter: the name of a trace file ("-" for standard input).  It drives
+// the branch predictor simulation by reading the trace file and feeding the
+// traces one at a time to the branch predictor.  A name beginning with
+// "synth:" stands for a synthetic branch stream described by the rest of
+// the name (see synth.cc) which is generated in memory instead of being
+// read from a file.
+//
+// These options may come before the file name:
+//
+// -P	measure cycles, instructions, L1D misses and host branch misses
+//	spent decoding, predicting and updating (see perf.h)
+// -j k	replay the trace approximately in k chunks on k threads (see chunked.h)
+// -w n	warm up each chunk's predictor on the n traces before it
+//	(default 1000000)
+// -V	also replay the trace serially and report the error of -j
+// -n n	stop after the first n traces
+// -S file	write predictions and misses by opcode and by kind of branch
+//	to file as JSON (see stats.h)
+// -H	put the predictor and decoder tables on huge pages (see arena.h)
+// -L n	fail if the tables would take more than n bytes
+// -R	report how much of each table was resident
+// -C file	look the run up in the result cache in file and print the
+//	cached result if it is there, else run it and add it (see cache.h).
+//	runs with -P, -V, -S or -R, or of standard input, aren't cached
+// -I q	take two or more trace files and interleave them like threads
+//	sharing one predictor, switching to the next one every q traces.
+//	each thread has its own history (see branch_predictor::thread_state) but
+//	they share the tables.  the misses of each thread are printed
+//	before the total
+// -D d	delay training until d more branches have been predicted, as in a
+//	pipeline with d branches in flight; the history is still updated
+//	at prediction time, with the predicted direction, and repaired at
+//	once on a misprediction (see branch_predictor::predict_ahead).
+//	-D 1 is the same as no delay
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> // in case you want to use e.g. memset
 #include <assert.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
 
 #include "branch.h"
 #include "trace.h"
+#include "synth.h"
+#include "perf.h"
+#include "arena.h"
 #include "predictor.h"
+#include "stats.h"
+#include "chunked.h"
+#include "cache.h"
+#include "saturate.h"
 #include "my_predictor.h"
 #include "piecewise.h"
+#include "hashed_perceptron.h"
+#include "loop_predictor.h"
 
 #include <iostream>
 using namespace std;
 
-int main (int argc, char *argv[]) {
+// the source of traces, and how many more to take from it when a prefix
+// of the trace is wanted, or -1 for all of them
 
-	// make sure there is one parameter
+static trace *(*source) (void);
+static long long int remaining = -1;
 
-	if (argc != 2) {
-		fprintf (stderr, "Usage: %s <filename>.gz\n", argv[0]);
-		exit (1);
+// get the next trace of the prefix
+
+static trace *read_prefix (void) {
+	if (remaining == 0) return NULL;
+	remaining--;
+	return source ();
+}
+
+// get the next trace of the prefix of a trace file and how many times in
+// a row it comes (see read_run)
+
+static trace *read_run_prefix (unsigned int *n) {
+	if (remaining == 0) return NULL;
+	unsigned int max = remaining > 0 && remaining < ~0U ? remaining : ~0U;
+	trace *t = read_run (max, n);
+	if (t && remaining > 0) remaining -= *n;
+	return t;
+}
+
+// the predictor to simulate; build with e.g. -DPREDICTOR=HashedPerceptron
+// for another one, and with -DLOOP_OVERRIDE=1 to put the loop predictor
+// in front of it (see loop_predictor.h)
+
+#ifndef PREDICTOR
+#define PREDICTOR	Piecewise
+#endif
+#ifndef LOOP_OVERRIDE
+#define LOOP_OVERRIDE	0
+#endif
+
+// make a new instance of the competitor's predictor
+
+static branch_predictor *new_predictor (void) {
+	branch_predictor *p = new PREDICTOR ();
+	return LOOP_OVERRIDE ? new LoopOverride (p) : p;
+}
+
+// the configuration the predictor was built with, to describe and key
+// runs in the result cache
+
+#define STRING(x)	#x
+#define EXPAND(x)	STRING(x)
+
+static const char *config_string =
+	"PREDICTOR=" EXPAND(PREDICTOR) " LOOP_OVERRIDE=" EXPAND(LOOP_OVERRIDE)
+	" M=" EXPAND(M) " N=" EXPAND(N) " H=" EXPAND(H) " THETA=" EXPAND(THETA)
+	" ADAPT_THETA=" EXPAND(ADAPT_THETA) " PW_INDEX=" EXPAND(PW_INDEX)
+	" HP_TABLES=" EXPAND(HP_TABLES) " HP_TABLE_BITS=" EXPAND(HP_TABLE_BITS)
+	" HP_MIN_HIST=" EXPAND(HP_MIN_HIST) " HP_MAX_HIST=" EXPAND(HP_MAX_HIST);
+
+// make the result cache key for a run on fname with the options that
+// change its result, and describe the run in desc.  the code version is
+// the digest of this executable.  return false if the run can't be cached
+
+static bool run_key (cache_key *k, char *desc, int len, const char *fname, long long int prefix, int chunks, long long int warmup, int depth) {
+	char opts[128];
+
+	if (strcmp (fname, "-") == 0) return false;
+	int n = snprintf (opts, sizeof (opts), "-n %lld -j %d -w %lld", prefix, chunks, chunks ? warmup : 0);
+	if (depth) snprintf (opts + n, sizeof (opts) - n, " -D %d", depth);
+	snprintf (desc, len, "%s %s %s", fname, opts, config_string);
+	init_key (k);
+	digest_string (k, opts);
+	digest_string (k, config_string);
+	if (!digest_file (k, "/proc/self/exe"))
+		digest_string (k, __DATE__ " " __TIME__);
+	if (strncmp (fname, SYNTH_PREFIX, strlen (SYNTH_PREFIX)) == 0)
+		digest_string (k, fname);
+	else if (!digest_file (k, fname))
+		return false;
+	return true;
+}
+
+// give final mispredictions per kilo-instruction and the miss rate.
+// each trace file represents exactly 100 million instructions.
+
+static void print_result (long long int dmiss, long long int conditional_total, int files = 1) {
+	printf ("%0.3f MPKI\n", 1000.0 * (dmiss / (files * 1e8)));
+	printf ("%lf\n", (double)dmiss/(double)conditional_total);
+}
+
+// feed the runs of a trace file from next_run to a new predictor a run at
+// a time, collecting statistics into s.  the predictor replays each run
+// as though it had been given its traces one at a time
+
+static void replay_runs (trace *(*next_run) (unsigned int *), replay_stats & s) {
+	branch_predictor *p = new_predictor ();
+	unsigned int n;
+
+	for (;;) {
+		trace *t = next_run (&n);
+		if (!t) break;
+		bool conditional = t->bi.br_flags & BR_CONDITIONAL;
+		if (n == 1) {
+			// most traces aren't in runs
+
+			branch_update *u = p->predict_and_update (t->bi, t->taken, t->target);
+			if (conditional) {
+				s.dmiss += u->direction_prediction () != t->taken;
+				s.tmiss += u->target_prediction () != t->target;
+			}
+		} else
+			p->replay_run (t->bi, t->taken, t->target, n, s.dmiss, s.tmiss);
+		s.conditional_total += conditional ? n : 0;
 	}
+	delete p;
+}
 
-	// open the trace file for reading
+// feed the traces from next_trace one at a time to a new predictor,
+// collecting statistics into s and, unless it is NULL, cs.  this is the
+// exact reference simulation
 
-	init_trace (argv[1]);
+static void replay_serial (trace *(*next_trace) (void), bool measure, char *fname, replay_stats & s, class_stats *cs) {
 
 	// initialize competitor's branch prediction code
 
-	branch_predictor *p = new Piecewise ();
+	branch_predictor *p = new_predictor ();
 
-	// some statistics to keep, currently just for conditional branches
-
-	long long int 
-		conditional_total = 0,
-		tmiss = 0, 	// number of target mispredictions
-		dmiss = 0; 	// number of direction mispredictions
+	if (measure) init_perf ();
 
 	// keep looping until end of file
 
@@ -48,15 +193,23 @@ int main (int argc, char *argv[]) {
 
 		// get a trace
 
-		trace *t = read_trace ();
+		if (measure) perf_mark (PERF_DECODE);
+		trace *t = next_trace ();
 
 		// NULL means end of file
 
 		if (!t) break;
 
-		// send this trace to the competitor's code for prediction
+		// send this trace to the competitor's code for prediction.
+		// unless the two are being timed separately, let it train on
+		// the outcome at the same time
 
-		branch_update *u = p->predict (t->bi);
+		branch_update *u;
+		if (measure) {
+			perf_mark (PERF_PREDICT);
+			u = p->predict (t->bi);
+		} else
+			u = p->predict_and_update (t->bi, t->taken, t->target);
 
 		// collect statistics for a conditional branch trace
 
@@ -64,29 +217,317 @@ int main (int argc, char *argv[]) {
 
 			// count a direction misprediction
 
-			dmiss += u->direction_prediction () != t->taken;
+			s.dmiss += u->direction_prediction () != t->taken;
 
 			// count a target misprediction
 
-			tmiss += u->target_prediction () != t->target;
+			s.tmiss += u->target_prediction () != t->target;
 			
-			conditional_total++;
+			s.conditional_total++;
 		}
+		if (cs) count_branch (cs, t, u);
 
-		// update competitor's state
+		// update competitor's state, unless predict_and_update already did
 
-		p->update (u, t->taken, t->target);
+		if (measure) {
+			perf_mark (PERF_UPDATE);
+			p->update (u, t->taken, t->target);
+		}
 	}
 
 	// done reading traces
 
-	end_trace ();
+	if (measure) {
+		perf_mark (PERF_IDLE);
+		print_perf (stderr, fname);
+		end_perf ();
+	}
+	delete p;
+}
 
-	// give final mispredictions per kilo-instruction and exit.
-	// each trace represents exactly 100 million instructions.
+// feed the traces from next_trace to a new predictor with depth branches
+// in flight, collecting statistics into s and, unless it is NULL, cs.  a
+// branch is predicted when it is read and trained depth branches later,
+// from a copy of its update kept in a ring allocated here once
 
-	printf ("%0.3f MPKI\n", 1000.0 * (dmiss / 1e8));
-	printf ("%lf\n", (double)dmiss/(double)conditional_total);
+static void replay_delayed (trace *(*next_trace) (void), int depth, replay_stats & s, class_stats *cs) {
+	branch_predictor *p = new_predictor ();
+	unsigned int size = p->update_size ();
+	if (!size) {
+		fprintf (stderr, "-D: the predictor doesn't support delayed update\n");
+		exit (1);
+	}
+
+	// the branches in flight, oldest at slot
+
+	struct outcome {
+		bool taken;
+		unsigned int target;
+	};
+	char *ring = (char *) malloc ((size_t) depth * size);
+	outcome *outcomes = (outcome *) malloc (depth * sizeof (outcome));
+	int slot = 0, in_flight = 0;
+
+	for (;;) {
+		trace *t = next_trace ();
+		if (!t) break;
+
+		// retire the oldest branch to make room for this one
+
+		branch_update *old = (branch_update *) (ring + (size_t) slot * size);
+		if (in_flight == depth)
+			p->retire (old, outcomes[slot].taken, outcomes[slot].target);
+		else
+			in_flight++;
+
+		branch_update *u = p->predict_ahead (t->bi);
+		if (t->bi.br_flags & BR_CONDITIONAL) {
+			s.dmiss += u->direction_prediction () != t->taken;
+			s.tmiss += u->target_prediction () != t->target;
+			s.conditional_total++;
+			if (u->direction_prediction () != t->taken) p->repair (u, t->taken);
+		}
+		if (cs) count_branch (cs, t, u);
+		memcpy (old, u, size);
+		outcomes[slot].taken = t->taken;
+		outcomes[slot].target = t->target;
+		if (++slot == depth) slot = 0;
+	}
+	free (ring);
+	free (outcomes);
+	delete p;
+}
+
+// read the trace, or its first max traces, into memory and replay it in
+// chunks on parallel threads, collecting statistics into s and cs.  with verify, also replay
+// it serially and report how far off the chunked replay was
+
+static void replay_parallel (trace *(*next_trace) (void), long long int max, int chunks, long long int warmup, bool verify, replay_stats & s, class_stats *cs) {
+	long long int n;
+	packed_trace *traces = load_traces (next_trace, max, &n);
+
+	replay_chunked (traces, n, chunks, warmup, new_predictor, &s, cs);
+	if (verify) {
+		replay_stats serial;
+		branch_predictor *p = new_predictor ();
+		replay_range (p, traces, 0, n, &serial, NULL);
+		delete p;
+		fprintf (stderr, "%d chunks: %lld misses; serial: %lld misses; error %+0.3f%%\n",
+			chunks, s.dmiss, serial.dmiss,
+			100.0 * (s.dmiss - serial.dmiss) / (double) serial.dmiss);
+	}
+	free (traces);
+}
+
+// open the trace file fname for reading, or set up the synthetic stream
+// it describes, and return the function that gets its traces
+
+static trace *(*open_source (char *prog, char *fname)) (void) {
+	if (strncmp (fname, SYNTH_PREFIX, strlen (SYNTH_PREFIX)) == 0) {
+		synth_params sp;
+		if (!parse_synth (fname, sp)) {
+			fprintf (stderr, "%s: bad stream description \"%s\"\n", prog, fname);
+			exit (1);
+		}
+		init_synth (sp);
+		return read_synth;
+	}
+	init_trace (fname);
+	return read_trace;
+}
+
+static void close_source (trace *(*next_trace) (void)) {
+	if (next_trace == read_synth)
+		end_synth ();
+	else
+		end_trace ();
+}
+
+// one thread of an interleaved replay: its traces, how far it has got,
+// its statistics and its saved history
+
+struct context {
+	char *fname;
+	packed_trace *traces;
+	long long int n, pos;
+	replay_stats s;
+	char *history;
+};
+
+// replay the k files in fnames interleaved into one predictor, quantum
+// traces at a time from each file in turn, collecting statistics for
+// each into c and for all of them into s and cs.  a file that runs out
+// drops out of the rotation.  switching saves the outgoing file's history
+// and restores the incoming one's; the tables carry over
+
+static void replay_interleaved (char *prog, char **fnames, int k, long long int quantum, long long int prefix, context *c, replay_stats & s, class_stats *cs) {
+	branch_predictor *p = new_predictor ();
+	state_io size (NULL, 0, false);
+	p->thread_state (size);
+
+	for (int i=0; i<k; i++) {
+		c[i].fname = fnames[i];
+		source = open_source (prog, fnames[i]);
+		c[i].traces = load_traces (source, prefix, &c[i].n);
+		close_source (source);
+		c[i].pos = 0;
+
+		// every file starts from the predictor's initial history
+
+		c[i].history = (char *) malloc (size.pos + 1);
+		state_io save (c[i].history, size.pos, false);
+		p->thread_state (save);
+	}
+	int current = 0, left = k;
+	while (left) {
+		left = 0;
+		for (int i=0; i<k; i++) {
+			if (c[i].pos == c[i].n) continue;
+			left++;
+			if (i != current) {
+				state_io save (c[current].history, size.pos, false);
+				p->thread_state (save);
+				state_io load (c[i].history, size.pos, true);
+				p->thread_state (load);
+				current = i;
+			}
+			long long int to = c[i].pos + quantum;
+			if (to > c[i].n) to = c[i].n;
+			replay_range (p, c[i].traces, c[i].pos, to, &c[i].s, cs);
+			c[i].pos = to;
+		}
+	}
+	for (int i=0; i<k; i++) {
+		s.conditional_total += c[i].s.conditional_total;
+		s.tmiss += c[i].s.tmiss;
+		s.dmiss += c[i].s.dmiss;
+		free (c[i].traces);
+		free (c[i].history);
+	}
 	delete p;
+}
+
+int main (int argc, char *argv[]) {
+
+	bool measure = false, verify = false;
+	int chunks = 0, opt;
+	long long int warmup = 1000000;
+	char *stats_name = NULL;
+	bool report_arena = false;
+	int arena_flags = 0;
+	unsigned long long int arena_limit = 0;
+	char *cache_name = NULL;
+	long long int quantum = 0;
+	int depth = 0;
+
+	while ((opt = getopt (argc, argv, "Pj:w:Vn:S:HL:RC:I:D:")) != -1) {
+		switch (opt) {
+		case 'P': measure = true; break;
+		case 'j': chunks = atoi (optarg); break;
+		case 'w': warmup = atoll (optarg); break;
+		case 'V': verify = true; break;
+		case 'n': remaining = atoll (optarg); break;
+		case 'S': stats_name = optarg; break;
+		case 'H': arena_flags |= ARENA_HUGE_PAGES; break;
+		case 'L': arena_limit = atoll (optarg); break;
+		case 'R': report_arena = true; arena_flags |= ARENA_REPORT; break;
+		case 'C': cache_name = optarg; break;
+		case 'I': quantum = atoll (optarg); break;
+		case 'D': depth = atoi (optarg); break;
+		default: argc = 0;
+		}
+	}
+
+	// make sure there is one parameter, or two or more to interleave
+
+	int files = argc - optind;
+	if (argc == 0 || chunks < 0 || warmup < 0 || quantum < 0 || depth < 0
+		|| (quantum ? files < 2 || chunks || measure || depth : files != 1)
+		|| (depth && (chunks || measure))) {
+		fprintf (stderr, "Usage: %s [-P] [-j chunks [-w warmup] [-V]] [-D depth] [-n traces] [-S stats.json] [-H] [-L bytes] [-R] [-C cache] <filename>.gz\n", argv[0]);
+		fprintf (stderr, "       %s -I quantum [-n traces] [-S stats.json] [-H] [-L bytes] [-R] <filename>.gz <filename>.gz...\n", argv[0]);
+		exit (1);
+	}
+	char *fname = argv[optind];
+
+	// a run that is in the cache is done
+
+	cache_key key;
+	char desc[512];
+	bool cached = cache_name && !quantum && !measure && !verify && !stats_name && !report_arena
+		&& run_key (&key, desc, sizeof (desc), fname, remaining, chunks, warmup, depth);
+	cache_result r;
+	if (cached && cache_lookup (cache_name, &key, &r)) {
+		print_result (r.dmiss, r.conditional_total);
+		exit (0);
+	}
+
+	init_arena (arena_flags, arena_limit);
+	struct timespec start, end;
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	// some statistics to keep, currently just for conditional branches
+
+	replay_stats s;
+	class_stats *cs = stats_name ? new class_stats : NULL;
+	context *c = NULL;
+
+	if (quantum) {
+		c = new context[files];
+		replay_interleaved (argv[0], argv + optind, files, quantum, remaining, c, s, cs);
+	} else {
+		// open the trace file for reading, or set up the synthetic stream
+
+		trace *(*first_trace) (void) = open_source (argv[0], fname);
+		trace *(*next_trace) (void) = first_trace;
+		if (remaining >= 0) {
+			source = next_trace;
+			next_trace = read_prefix;
+		}
+
+		// a trace file may have runs to replay at once, unless the
+		// branches are being timed or counted one at a time
+
+		if (chunks)
+			replay_parallel (first_trace, remaining, chunks, warmup, verify, s, cs);
+		else if (depth)
+			replay_delayed (next_trace, depth, s, cs);
+		else if (first_trace == read_trace && !measure && !cs)
+			replay_runs (read_run_prefix, s);
+		else
+			replay_serial (next_trace, measure, fname, s, cs);
+
+		close_source (first_trace);
+	}
+	if (report_arena) print_arena (stderr);
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	if (cached) {
+		r.conditional_total = s.conditional_total;
+		r.tmiss = s.tmiss;
+		r.dmiss = s.dmiss;
+		r.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		cache_store (cache_name, &key, &r, desc);
+	}
+
+	if (cs) {
+		FILE *f = fopen (stats_name, "w");
+		if (!f) {
+			perror (stats_name);
+			exit (1);
+		}
+		print_class_stats (f, fname, cs);
+		fclose (f);
+		delete cs;
+	}
+
+	if (c) {
+		for (int i=0; i<files; i++)
+			printf ("%s: %0.3f MPKI %lf\n", c[i].fname, 1000.0 * (c[i].s.dmiss / 1e8),
+				(double) c[i].s.dmiss / (double) c[i].s.conditional_total);
+		delete[] c;
+	} else
+		files = 1;
+	print_result (s.dmiss, s.conditional_total, files);
 	exit (0);
 }
@@ -1,9 +1,19 @@
 // predictor.h
 // This file declares branch_update and branch_predictor classes.
 
+// how sure a predictor is of a direction prediction.  each predictor
+// decides for itself where the lines between the classes go
+
+#define CONFIDENCE_LOW		0
+#define CONFIDENCE_MEDIUM	1
+#define CONFIDENCE_HIGH		2
+#define CONFIDENCE_NCLASSES	3
+
 class branch_update {
 	bool _direction_prediction;
 	unsigned int _target_prediction;
+	unsigned int _confidence;	// e.g. a perceptron's |output|; bigger is surer
+	int _confidence_class;		// one of the CONFIDENCE_ classes
 
 public:
 	bool direction_prediction () { return _direction_prediction; }
@@ -12,13 +22,112 @@ public:
 	bool target_prediction () { return _target_prediction; }
 	void target_prediction (unsigned int t) { _target_prediction = t; }
 
+	unsigned int confidence () { return _confidence; }
+	int confidence_class () { return _confidence_class; }
+	void confidence (unsigned int c, int cls) { _confidence = c; _confidence_class = cls; }
+
+	// predictors that don't estimate confidence claim to be sure
+
 	branch_update (void) : 
-		_direction_prediction(false), _target_prediction(0) {}
+		_direction_prediction(false), _target_prediction(0),
+		_confidence(0), _confidence_class(CONFIDENCE_HIGH) {}
+};
+
+// copies a predictor's state to or from a buffer, one piece at a time, so
+// a predictor lists its tables and registers once for both directions.
+// pos counts the bytes the state takes even when they don't fit in len
+
+struct state_io {
+	unsigned char *buf;
+	unsigned long long int len, pos;
+	bool load;
+
+	state_io (void *b, unsigned long long int n, bool l) :
+		buf((unsigned char *) b), len(n), pos(0), load(l) {}
+
+	void piece (void *p, unsigned long long int n) {
+		if (pos + n <= len) {
+			if (load)
+				memcpy (p, buf + pos, n);
+			else
+				memcpy (buf + pos, p, n);
+		}
+		pos += n;
+	}
 };
 
 class branch_predictor {
 public:
 	virtual branch_update *predict (branch_info &) = 0;
 	virtual void update (branch_update *, bool, unsigned int) {}
+
+	// predict a branch whose outcome is already known and train on it.
+	// predictors can override this to do both in one pass; the results
+	// must be the same as calling predict and then update
+
+	virtual branch_update *predict_and_update (branch_info & b, bool taken, unsigned int target) {
+		branch_update *u = predict (b);
+		update (u, taken, target);
+		return u;
+	}
+
+	// replay a run of n of the same branch with the same outcome, as n
+	// calls to predict_and_update would, adding the direction and target
+	// misses of a conditional branch to dmiss and tmiss, and return the
+	// last update.  once settled says another call would change nothing,
+	// the rest of the run is counted without calling it
+
+	virtual branch_update *replay_run (branch_info & b, bool taken, unsigned int target, long long int n, long long int & dmiss, long long int & tmiss) {
+		branch_update *u = NULL;
+		bool conditional = b.br_flags & BR_CONDITIONAL;
+		for (long long int i=0; i<n; i++) {
+			u = predict_and_update (b, taken, target);
+			bool tm = u->target_prediction () != target;
+			if (conditional) {
+				dmiss += u->direction_prediction () != taken;
+				tmiss += tm;
+			}
+			if (settled (b, taken, i + 1)) {
+				if (conditional) tmiss += tm * (n - i - 1);
+				break;
+			}
+		}
+		return u;
+	}
+
+	// whether predicting b again, after the last k calls of
+	// predict_and_update were all for b with this outcome, would predict
+	// the outcome right, predict the same target as the last call and
+	// leave the state as it is.  false is always safe
+
+	virtual bool settled (branch_info &, bool, long long int) { return false; }
+
+	// delayed update, for a pipeline that predicts branches well before
+	// they retire (see predict.cc -D).  predict_ahead predicts b and at
+	// once shifts the predicted direction into the history, the way fetch
+	// would, and returns an update holding everything the other two need,
+	// including a checkpoint of the history; the caller keeps a copy of
+	// update_size bytes of it.  if the prediction was wrong, repair puts
+	// the outcome into the history instead, before the next prediction.
+	// retire trains the tables on the outcome of a copy, which may be many
+	// predictions old, without touching the history.  a predictor that
+	// doesn't support it leaves update_size 0
+
+	virtual unsigned int update_size (void) { return 0; }
+	virtual branch_update *predict_ahead (branch_info & b) { return predict (b); }
+	virtual void repair (branch_update *, bool) {}
+	virtual void retire (branch_update *, bool, unsigned int) {}
+
+	// save or restore everything the predictions depend on; see state_io.
+	// a predictor with no state of its own needn't override this
+
+	virtual void state (state_io &) {}
+
+	// save or restore just the part of the state that belongs to one
+	// thread of execution, like the global history, for replaying several
+	// threads into one predictor whose tables they share.  it should be
+	// small, since it is swapped at every switch between threads
+
+	virtual void thread_state (state_io &) {}
 	virtual ~branch_predictor (void) {}
 };
@@ -0,0 +1,123 @@
+// satbench.cc
+// This file contains a microbenchmark for the saturating counter updates in
+// saturate.h.  It trains a table of perceptron weights and a table of 2-bit
+// counters with random outcomes, once with the original if-based code from
+// Piecewise::update and my_predictor::update and once with the branch-free
+// helpers, checks that both leave identical tables, and reports the time and
+// host branch misses per update for each (see perf.h).
+//
+// satbench [updates]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perf.h"
+#include "saturate.h"
+
+#define TABLE_SIZE	(1<<16)
+
+// one random training event
+
+struct event {
+	unsigned int index;
+	bool taken;
+};
+
+static event *events;
+static int nevents;
+
+// the if-based perceptron weight update
+
+static void weights_branchy (void *table) {
+	char *w = (char *) table;
+
+	for (int i=0; i<nevents; i++) {
+		char *c = &w[events[i].index];
+		bool agree = events[i].taken;
+		if (agree && *c < 127) (*c)++;
+		if (!agree && *c > -127) (*c)--;
+	}
+}
+
+// the branch-free perceptron weight update
+
+static void weights_branchless (void *table) {
+	char *w = (char *) table;
+
+	for (int i=0; i<nevents; i++) {
+		char *c = &w[events[i].index];
+		*c = sat_add (*c, sign_of (events[i].taken), -127, 127);
+	}
+}
+
+// the if-based 2-bit counter update
+
+static void counters_branchy (void *table) {
+	unsigned char *tab = (unsigned char *) table;
+
+	for (int i=0; i<nevents; i++) {
+		unsigned char *c = &tab[events[i].index];
+		if (events[i].taken) {
+			if (*c < 3) (*c)++;
+		} else {
+			if (*c > 0) (*c)--;
+		}
+	}
+}
+
+// the branch-free 2-bit counter update
+
+static void counters_branchless (void *table) {
+	unsigned char *tab = (unsigned char *) table;
+
+	for (int i=0; i<nevents; i++) {
+		unsigned char *c = &tab[events[i].index];
+		*c = sat_add (*c, sign_of (events[i].taken), 0, 3);
+	}
+}
+
+// run one variant on a fresh table and report it
+
+static void run (const char *name, void (*f) (void *), void *table) {
+	unsigned long long int counts[PERF_NCOUNTERS], nsec;
+
+	memset (table, 0, TABLE_SIZE);
+	bool hw = init_perf ();
+	perf_mark (PERF_UPDATE);
+	f (table);
+	perf_mark (PERF_IDLE);
+	perf_totals (PERF_UPDATE, counts, &nsec);
+	end_perf ();
+	printf ("%-20s %8.3f ns/update", name, nsec / (double) nevents);
+	if (hw)
+		printf (" %8.4f branch misses/update %8.3f cycles/update",
+			counts[PERF_BRANCH_MISSES] / (double) nevents,
+			counts[PERF_CYCLES] / (double) nevents);
+	printf ("\n");
+}
+
+int main (int argc, char *argv[]) {
+	nevents = argc > 1 ? atoi (argv[1]) : 1 << 24;
+	events = new event[nevents];
+
+	// outcomes about as biased and as irregular as the ones in the traces
+
+	srandom (1);
+	for (int i=0; i<nevents; i++) {
+		events[i].index = random () % TABLE_SIZE;
+		events[i].taken = (random () % 100) < 55;
+	}
+	static char w1[TABLE_SIZE], w2[TABLE_SIZE];
+	static unsigned char c1[TABLE_SIZE], c2[TABLE_SIZE];
+	run ("weights, if", weights_branchy, w1);
+	run ("weights, branchless", weights_branchless, w2);
+	run ("counters, if", counters_branchy, c1);
+	run ("counters, branchless", counters_branchless, c2);
+	if (memcmp (w1, w2, sizeof (w1)) || memcmp (c1, c2, sizeof (c1))) {
+		fprintf (stderr, "branch-free updates don't match the originals!\n");
+		exit (1);
+	}
+	delete[] events;
+	exit (0);
+}
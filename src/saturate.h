@@ -0,0 +1,34 @@
+// saturate.h
+// Branch-free helpers for training the predictor tables.  Outcomes in the
+// traces are exactly the kind of irregular data the host CPU can't predict,
+// so the counters and weights are moved with selects the compiler turns into
+// conditional moves rather than with ifs.
+
+// add d to x and clamp the result to [lo, hi]
+
+static inline int sat_add (int x, int d, int lo, int hi) {
+	x += d;
+	x = x < lo ? lo : x;
+	return x > hi ? hi : x;
+}
+
+// +1 if b is true, -1 if it is false
+
+static inline int sign_of (bool b) {
+	return ((int) b << 1) - 1;
+}
+
+// x if b is true, -x if it is false
+
+static inline int select_sign (int x, bool b) {
+	int m = (int) b - 1;
+	return (x ^ m) - m;
+}
+
+// rotate x left one bit, so bit i of the result is bit i-1 of x and bit 0
+// is bit 63.  the perceptron pairs weight i with history bit i-1; this gives
+// one mask to test for all of them, weight 0 included
+
+static inline unsigned long long int rotl1 (unsigned long long int x) {
+	return (x << 1) | (x >> 63);
+}
@@ -0,0 +1,160 @@
+// shmtrace.cc
+// This file contains the shared memory traces declared in shmtrace.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "shmtrace.h"
+
+// the server publishes and grows the segment this many traces at a time
+
+#define SHM_BATCH	(1<<16)
+#define SHM_GROW	(1ULL<<22)
+
+// how long a reader that has caught up sleeps before looking again
+
+#define SHM_POLL_US	200
+
+static shm_trace_header *header;
+static int shmfd = -1;
+static unsigned long long int mapped;	// bytes mapped
+
+// the server's side
+
+static unsigned long long int written, allocated;
+
+// the reader's side
+
+packed_trace *shm_traces;
+unsigned long long int shm_pos, shm_ready;
+
+static unsigned long long int segment_size (unsigned long long int n) {
+	return SHM_HEADER_SIZE + n * sizeof (packed_trace);
+}
+
+// create the segment with room to grow to capacity traces.  the mapping
+// reserves that much address space, but the segment itself only grows as
+// traces are written
+
+bool create_shm_trace (const char *name, unsigned long long int capacity) {
+	shmfd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (shmfd < 0) {
+		perror (name);
+		return false;
+	}
+	mapped = segment_size (capacity);
+	void *p = mmap (NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, shmfd, 0);
+	if (p == MAP_FAILED || ftruncate (shmfd, SHM_HEADER_SIZE)) {
+		perror (name);
+		shm_unlink (name);
+		return false;
+	}
+	header = (shm_trace_header *) p;
+	header->capacity = capacity;
+	header->ready = 0;
+	header->done = 0;
+	header->pid = getpid ();
+	__atomic_store_n (&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	written = 0;
+	allocated = 0;
+	return true;
+}
+
+// add a trace to the segment, growing it first if it is full.  the space
+// is allocated rather than just truncated to so running out of it is an
+// error here instead of a SIGBUS later
+
+void append_shm_trace (trace *t) {
+	if (written == allocated) {
+		if (written == header->capacity) {
+			fprintf (stderr, "append_shm_trace: more than %llu traces\n", header->capacity);
+			exit (1);
+		}
+		allocated += SHM_GROW;
+		if (allocated > header->capacity) allocated = header->capacity;
+		int e = posix_fallocate (shmfd, 0, segment_size (allocated));
+		if (e) {
+			fprintf (stderr, "append_shm_trace: %s\n", strerror (e));
+			exit (1);
+		}
+	}
+	packed_trace *traces = (packed_trace *) ((char *) header + SHM_HEADER_SIZE);
+	pack_trace (t, &traces[written++]);
+	if (written % SHM_BATCH == 0)
+		__atomic_store_n (&header->ready, written, __ATOMIC_RELEASE);
+}
+
+// publish the last traces and tell readers that's all
+
+void finish_shm_trace (void) {
+	__atomic_store_n (&header->ready, written, __ATOMIC_RELEASE);
+	__atomic_store_n (&header->done, 1, __ATOMIC_RELEASE);
+}
+
+// remove the segment; readers that have it mapped keep it until they're done
+
+void remove_shm_trace (const char *name) {
+	shm_unlink (name);
+}
+
+// map the segment for reading; false if there isn't one
+
+bool attach_shm_trace (const char *name) {
+	shmfd = shm_open (name, O_RDONLY, 0);
+	if (shmfd < 0) return false;
+	shm_trace_header h;
+	if (pread (shmfd, &h, sizeof (h), 0) != (ssize_t) sizeof (h) || h.magic != SHM_MAGIC) {
+		close (shmfd);
+		shmfd = -1;
+		return false;
+	}
+	mapped = segment_size (h.capacity);
+	void *p = mmap (NULL, mapped, PROT_READ, MAP_SHARED, shmfd, 0);
+	if (p == MAP_FAILED) {
+		close (shmfd);
+		shmfd = -1;
+		return false;
+	}
+	header = (shm_trace_header *) p;
+	shm_traces = (packed_trace *) ((char *) p + SHM_HEADER_SIZE);
+	shm_pos = 0;
+	shm_ready = 0;
+	return true;
+}
+
+// called when the reader has used every trace it knew of: wait until the
+// server publishes more and return true, or return false at the end of
+// the trace.  a server that died without finishing is an error, since the
+// trace is incomplete
+
+bool wait_shm_trace (void) {
+	for (;;) {
+		int done = __atomic_load_n (&header->done, __ATOMIC_ACQUIRE);
+		shm_ready = __atomic_load_n (&header->ready, __ATOMIC_ACQUIRE);
+		if (shm_pos < shm_ready) return true;
+		if (done) return false;
+		if (kill (header->pid, 0) && errno == ESRCH) {
+			fprintf (stderr, "wait_shm_trace: the trace server went away\n");
+			exit (1);
+		}
+		usleep (SHM_POLL_US);
+	}
+}
+
+void detach_shm_trace (void) {
+	if (!header) return;
+	munmap (header, mapped);
+	close (shmfd);
+	header = NULL;
+	shm_traces = NULL;
+	shmfd = -1;
+}
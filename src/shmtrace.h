@@ -0,0 +1,39 @@
+// shmtrace.h
+// This file declares a decoded trace in POSIX shared memory, so that many
+// simulations of the same trace can share one decode.  traceserve decodes a
+// trace once into a segment of packed traces that grows as it goes and
+// publishes how many are ready after each batch.  A program reading the
+// trace named "shm:<name>" (see init_trace) maps the segment read-only and
+// takes the packed traces straight from it, at its own pace, with a cursor
+// of its own; it needs no decoder tables, and a reader that gets ahead of
+// the server waits for the next batch.  Readers never write to the segment,
+// so they need no locks, and one that starts late still sees the whole
+// trace.
+
+#define SHM_PREFIX	"shm:"
+
+// the start of the segment; the traces follow at SHM_HEADER_SIZE
+
+#define SHM_MAGIC	0x31656361727462ULL	// "btrace1"
+#define SHM_HEADER_SIZE	4096
+
+struct shm_trace_header {
+	unsigned long long int magic;
+	unsigned long long int capacity;	// traces the mapping can hold
+	unsigned long long int ready;		// traces written so far
+	int done;				// no more are coming
+	int pid;				// of the server
+};
+
+// the reader's view of the segment, for the inline fast path in trace.cc
+
+extern packed_trace *shm_traces;
+extern unsigned long long int shm_pos, shm_ready;
+
+bool create_shm_trace (const char *, unsigned long long int);
+void append_shm_trace (trace *);
+void finish_shm_trace (void);
+void remove_shm_trace (const char *);
+bool attach_shm_trace (const char *);
+bool wait_shm_trace (void);
+void detach_shm_trace (void);
@@ -0,0 +1,129 @@
+// stats.cc
+// This file contains the per-class statistics declared in stats.h.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "predictor.h"
+#include "stats.h"
+
+static const char *opcode_names[16] = {
+	"JO", "JNO", "JC", "JNC", "JZ", "JNZ", "JBE", "JA",
+	"JS", "JNS", "JP", "JNP", "JL", "JGE", "JLE", "JG"
+};
+
+static const char *flag_names[4] = { "conditional", "indirect", "call", "return" };
+
+static const char *confidence_names[CONFIDENCE_NCLASSES] = { "low", "medium", "high" };
+
+// add the counts in b to a
+
+void add_class_stats (class_stats *a, const class_stats *b) {
+	for (int i=0; i<16; i++)
+		for (int j=0; j<4; j++) {
+			a->opcode[i][j] += b->opcode[i][j];
+			a->flags[i][j] += b->flags[i][j];
+		}
+	for (int i=0; i<2; i++) {
+		for (int j=0; j<CONFIDENCE_NCLASSES; j++) a->confidence[j][i] += b->confidence[j][i];
+		for (int j=0; j<MAGNITUDE_BUCKETS; j++) a->magnitude[j][i] += b->magnitude[j][i];
+	}
+}
+
+// write s as a JSON string
+
+static void print_string (FILE *f, const char *s) {
+	fputc ('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf (f, "\\%c", *s);
+		else if ((unsigned char) *s < ' ')
+			fprintf (f, "\\u%04x", *s);
+		else
+			fputc (*s, f);
+	}
+	fputc ('"', f);
+}
+
+// write the name of a combination of BR_ flags, e.g. "indirect+call"; a
+// branch with none of them is a direct unconditional jump
+
+static void print_flags (FILE *f, int flags) {
+	fputc ('"', f);
+	if (!flags) fprintf (f, "jump");
+	for (int i=0, first=1; i<4; i++)
+		if (flags & (1 << i)) {
+			fprintf (f, "%s%s", first ? "" : "+", flag_names[i]);
+			first = 0;
+		}
+	fputc ('"', f);
+}
+
+// write the predictions, misses and miss rate in c[0] and c[1]
+
+static void print_misses (FILE *f, const unsigned long long int *c) {
+	fprintf (f, "{ \"predictions\": %llu, \"misses\": %llu, \"miss_rate\": %0.6f }",
+		c[0], c[1], c[0] ? c[1] / (double) c[0] : 0.0);
+}
+
+static void print_confusion (FILE *f, const unsigned long long int *c) {
+	unsigned long long int n = c[0] + c[1] + c[2] + c[3];
+	unsigned long long int miss = c[CONF_NT_PRED_T] + c[CONF_T_PRED_NT];
+
+	fprintf (f, "{ \"predictions\": %llu, \"misses\": %llu, \"miss_rate\": %0.6f, "
+		"\"taken\": %llu, \"not_taken\": %llu, "
+		"\"taken_predicted_not_taken\": %llu, \"not_taken_predicted_taken\": %llu }",
+		n, miss, n ? miss / (double) n : 0.0,
+		c[CONF_T_PRED_NT] + c[CONF_T_PRED_T], c[CONF_NT_PRED_NT] + c[CONF_NT_PRED_T],
+		c[CONF_T_PRED_NT], c[CONF_NT_PRED_T]);
+}
+
+// write the statistics for the named trace as one JSON object.  opcodes and
+// flag classes that never occurred are left out
+
+void print_class_stats (FILE *f, const char *name, const class_stats *s) {
+	unsigned long long int total[4] = { 0, 0, 0, 0 };
+
+	fprintf (f, "{\n  \"trace\": ");
+	print_string (f, name);
+	fprintf (f, ",\n  \"opcodes\": {");
+	for (int i=0, first=1; i<16; i++) {
+		const unsigned long long int *c = s->opcode[i];
+		for (int j=0; j<4; j++) total[j] += c[j];
+		if (!(c[0] + c[1] + c[2] + c[3])) continue;
+		fprintf (f, "%s\n    \"%s\": ", first ? "" : ",", opcode_names[i]);
+		print_confusion (f, c);
+		first = 0;
+	}
+	fprintf (f, "\n  },\n  \"conditional\": ");
+	print_confusion (f, total);
+	fprintf (f, ",\n  \"classes\": {");
+	for (int i=0, first=1; i<16; i++) {
+		const unsigned long long int *c = s->flags[i];
+		unsigned long long int n = c[0] + c[1] + c[2] + c[3];
+		if (!n) continue;
+		fprintf (f, "%s\n    ", first ? "" : ",");
+		print_flags (f, i);
+		fprintf (f, ": { \"branches\": %llu, \"direction_misses\": %llu, \"target_misses\": %llu }",
+			n, c[MISS_DIRECTION] + c[MISS_BOTH], c[MISS_TARGET] + c[MISS_BOTH]);
+		first = 0;
+	}
+	fprintf (f, "\n  },\n  \"confidence\": {");
+	for (int i=0; i<CONFIDENCE_NCLASSES; i++) {
+		fprintf (f, "%s\n    \"%s\": ", i ? "," : "", confidence_names[i]);
+		print_misses (f, s->confidence[i]);
+	}
+
+	// magnitude buckets are named by the smallest magnitude in them
+
+	fprintf (f, "\n  },\n  \"magnitude\": {");
+	for (int i=0, first=1; i<MAGNITUDE_BUCKETS; i++) {
+		if (!s->magnitude[i][0]) continue;
+		fprintf (f, "%s\n    \"%u\": ", first ? "" : ",", i ? 1u << (i-1) : 0);
+		print_misses (f, s->magnitude[i]);
+		first = 0;
+	}
+	fprintf (f, "\n  }\n}\n");
+}
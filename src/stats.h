@@ -0,0 +1,67 @@
+// stats.h
+// This file declares per-class statistics for a simulation: predictions and
+// misses broken out by the opcode of conditional branches and by the BR_
+// flags of all branches, with taken/not-taken confusion counts, and by how
+// confident the predictor was.  They are kept in fixed arrays of counters
+// indexed by the outcome, so counting a branch is a handful of adds with no
+// branches of its own, and written out as JSON when the simulation is done.
+
+// index into the confusion counts: actual direction times 2 plus predicted
+
+#define CONF_NT_PRED_NT	0
+#define CONF_NT_PRED_T	1
+#define CONF_T_PRED_NT	2
+#define CONF_T_PRED_T	3
+
+// index into the per-flag counts: direction miss times 2 plus target miss
+
+#define MISS_NONE	0
+#define MISS_TARGET	1
+#define MISS_DIRECTION	2
+#define MISS_BOTH	3
+
+// confidence magnitudes are binned by bit length: bucket 0 holds 0, bucket
+// i holds [2^(i-1), 2^i) and the last bucket holds everything bigger
+
+#define MAGNITUDE_BUCKETS	16
+
+struct class_stats {
+	// confusion counts for conditional branches by opcode
+
+	unsigned long long int opcode[16][4];
+
+	// miss counts for all branches by their BR_ flags
+
+	unsigned long long int flags[16][4];
+
+	// predictions and misses of conditional branches by confidence class
+	// and by the bit length of the confidence magnitude
+
+	unsigned long long int confidence[CONFIDENCE_NCLASSES][2];
+	unsigned long long int magnitude[MAGNITUDE_BUCKETS][2];
+
+	class_stats (void) { memset (this, 0, sizeof (*this)); }
+};
+
+// count one branch with its prediction.  unconditional branches add 0 to
+// the opcode table and never count as direction misses
+
+static inline void count_branch (class_stats *c, trace *t, branch_update *u) {
+	unsigned int cond = t->bi.br_flags & BR_CONDITIONAL;
+	unsigned int pred = u->direction_prediction ();
+	unsigned int dmiss = (pred ^ t->taken) & cond;
+	unsigned int tmiss = u->target_prediction () != t->target;
+
+	unsigned int bits = 31 - __builtin_clz (u->confidence () << 1 | 1);
+	unsigned int bucket = bits < MAGNITUDE_BUCKETS - 1 ? bits : MAGNITUDE_BUCKETS - 1;
+
+	c->opcode[t->bi.opcode & 15][t->taken << 1 | pred] += cond;
+	c->flags[t->bi.br_flags & 15][dmiss << 1 | tmiss]++;
+	c->confidence[u->confidence_class ()][0] += cond;
+	c->confidence[u->confidence_class ()][1] += dmiss;
+	c->magnitude[bucket][0] += cond;
+	c->magnitude[bucket][1] += dmiss;
+}
+
+void add_class_stats (class_stats *, const class_stats *);
+void print_class_stats (FILE *, const char *, const class_stats *);
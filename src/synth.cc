@@ -0,0 +1,203 @@
+// synth.cc
+// This file contains a generator for synthetic branch streams.  It walks a
+// random control flow graph of a given number of static branches.  Each
+// conditional branch outcome is a fixed random boolean function of the last
+// few global outcomes, so the correlation depth, the taken bias and the
+// branch footprint can each be dialed in independently.  Optionally some
+// conditional branches are tight loops instead: they jump to themselves a
+// fixed number of times and then fall through, giving long runs of the same
+// trace.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "synth.h"
+
+// the parameters of the stream being generated
+
+static synth_params sp;
+
+// one static branch in the control flow graph
+
+struct synth_branch {
+	unsigned int address;		// address of the branch
+	unsigned int target;		// where it goes when taken
+	unsigned int taken_next;	// static branch reached when taken
+	unsigned char code;		// trace code (kind << 4 | opcode)
+	unsigned long long int salt;	// selects the outcome function
+	unsigned int trip;		// iterations if it is a tight loop, else 0
+	unsigned int iter;		// iterations of the loop so far
+};
+
+static synth_branch *sb;
+
+// state of the walk
+
+static unsigned int cur;
+static unsigned long long int hist, hist_mask;
+static long long int generated;
+static unsigned long long int rng;
+
+// xorshift64* random number generator
+
+static unsigned long long int next_random (void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+// a random number in [0,1)
+
+static double next_uniform (void) {
+	return (next_random () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// mix the bits of x; used to make a random boolean function of the history
+
+static unsigned long long int mix (unsigned long long int x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// parse a comma-separated list of key=value pairs, optionally preceded by
+// SYNTH_PREFIX, into p.  return false if the spec is malformed
+
+bool parse_synth (const char *spec, synth_params & p) {
+	if (strncmp (spec, SYNTH_PREFIX, strlen (SYNTH_PREFIX)) == 0)
+		spec += strlen (SYNTH_PREFIX);
+	while (*spec) {
+		char key[32];
+		const char *eq = strchr (spec, '=');
+		if (!eq || eq - spec >= (int) sizeof (key)) return false;
+		memcpy (key, spec, eq - spec);
+		key[eq - spec] = 0;
+		char *end;
+		const char *val = eq + 1;
+		if (!strcmp (key, "n")) p.count = strtoll (val, &end, 0);
+		else if (!strcmp (key, "branches")) p.branches = strtoul (val, &end, 0);
+		else if (!strcmp (key, "depth")) p.depth = strtoul (val, &end, 0);
+		else if (!strcmp (key, "bias")) p.bias = strtod (val, &end);
+		else if (!strcmp (key, "uncond")) p.uncond = strtod (val, &end);
+		else if (!strcmp (key, "noise")) p.noise = strtod (val, &end);
+		else if (!strcmp (key, "seed")) p.seed = strtoull (val, &end, 0);
+		else if (!strcmp (key, "loops")) p.loops = strtod (val, &end);
+		else if (!strcmp (key, "trip")) p.trip = strtoul (val, &end, 0);
+		else return false;
+		if (end == val) return false;
+		spec = end;
+		if (*spec == ',') spec++;
+		else if (*spec) return false;
+	}
+	return p.branches > 0 && p.depth <= 64 && p.trip > 0;
+}
+
+// build the control flow graph and get ready to walk it
+
+void init_synth (const synth_params & p) {
+	sp = p;
+	rng = sp.seed * 0x9e3779b97f4a7c15ULL + 1;
+	sb = new synth_branch[sp.branches];
+
+	// lay the branches out in memory a few instructions apart
+
+	unsigned int a = 0x08048000;
+	for (unsigned int i=0; i<sp.branches; i++) {
+		a += 2 + (next_random () % 48);
+		sb[i].address = a;
+		sb[i].salt = next_random ();
+		unsigned int opcode = next_random () % 16;
+		if (next_uniform () < sp.uncond)
+			sb[i].code = 0x30 | opcode;
+		else
+			sb[i].code = 0x10 | opcode;
+
+		// a stream without loops draws no more random numbers, so it
+		// stays the same as before there were loops
+
+		sb[i].trip = 0;
+		sb[i].iter = 0;
+		if (sp.loops > 0 && (sb[i].code >> 4) == 1 && next_uniform () < sp.loops)
+			sb[i].trip = 1 + next_random () % (2 * sp.trip);
+	}
+
+	// not taken falls through to the next branch.  taken mostly jumps
+	// a short way back, like a loop, or forward, like an if, and
+	// sometimes anywhere at all.  the walk drifts forward on the whole
+	// so every branch in the footprint gets its turn.  unconditional
+	// branches only jump forward so they can't make a loop nothing
+	// ever leaves
+
+	for (unsigned int i=0; i<sp.branches; i++) {
+		unsigned int j;
+		if (sb[i].trip) {
+			sb[i].taken_next = i;
+			sb[i].target = sb[i].address;
+			continue;
+		}
+		if ((sb[i].code >> 4) == 3)
+			j = (i + 1 + next_random () % 32) % sp.branches;
+		else if (next_uniform () < 0.9) {
+			unsigned int d = next_random () % 48;
+			j = (i + sp.branches - 16 % sp.branches + d % sp.branches) % sp.branches;
+		} else
+			j = next_random () % sp.branches;
+		sb[i].taken_next = j;
+		sb[i].target = sb[j].address - (next_random () % 4) * 4;
+	}
+	hist_mask = sp.depth >= 64 ? ~0ULL : (1ULL << sp.depth) - 1;
+	hist = 0;
+	cur = 0;
+	generated = 0;
+}
+
+// generate the next trace; NULL after count traces
+
+trace *read_synth (void) {
+	static trace t;
+
+	if (generated == sp.count) return NULL;
+	generated++;
+	synth_branch *b = &sb[cur];
+	t.bi.address = b->address;
+	t.bi.opcode = b->code & 15;
+	t.target = b->target;
+	if ((b->code >> 4) == 3) {
+		t.bi.br_flags = 0;
+		t.taken = true;
+	} else if (b->trip) {
+		// a tight loop goes around trip times and then falls through
+
+		t.taken = b->iter < b->trip;
+		b->iter = t.taken ? b->iter + 1 : 0;
+		t.bi.br_flags = BR_CONDITIONAL;
+		hist = (hist << 1) | t.taken;
+	} else {
+		// the outcome is a fixed function of the recent history with
+		// the requested bias, flipped now and then
+
+		unsigned long long int h = mix ((hist & hist_mask) ^ b->salt);
+		t.taken = (h >> 11) * (1.0 / 9007199254740992.0) < sp.bias;
+		if (sp.noise > 0 && next_uniform () < sp.noise)
+			t.taken = !t.taken;
+		t.bi.br_flags = BR_CONDITIONAL;
+		hist = (hist << 1) | t.taken;
+	}
+	cur = t.taken ? b->taken_next : (cur + 1) % sp.branches;
+	return & t;
+}
+
+// free the control flow graph
+
+void end_synth (void) {
+	delete[] sb;
+	sb = NULL;
+}
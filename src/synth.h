@@ -0,0 +1,40 @@
+// synth.h
+// This file declares a generator for synthetic branch streams.  The streams
+// are produced one trace at a time just like read_trace so they can be fed
+// straight to a branch predictor, or written out in the trace file format
+// by tracegen.
+
+// parameters for a synthetic stream
+
+struct synth_params {
+	long long int count;		// number of traces to generate
+	unsigned int branches;		// number of static branches (footprint)
+	unsigned int depth;		// global history bits an outcome depends on
+	double bias;			// probability a conditional branch is taken
+	double uncond;			// fraction of unconditional static branches
+	double noise;			// probability an outcome is flipped at random
+	double loops;			// fraction of conditional branches that are tight loops
+	unsigned int trip;		// average iterations of a tight loop
+	unsigned long long int seed;	// seed for the random number generator
+
+	synth_params (void) {
+		count = 10000000;
+		branches = 4096;
+		depth = 8;
+		bias = 0.6;
+		uncond = 0.1;
+		noise = 0.05;
+		loops = 0;
+		trip = 100;
+		seed = 1;
+	}
+};
+
+// prefix that names a synthetic stream in place of a trace file name
+
+#define SYNTH_PREFIX	"synth:"
+
+bool parse_synth (const char *, synth_params &);
+void init_synth (const synth_params &);
+trace *read_synth (void);
+void end_synth (void);
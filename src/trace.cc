@@ -9,9 +9,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "branch.h"
 #include "trace.h"
+#include "arena.h"
+#include "bunzip.h"
+#include "shmtrace.h"
 
 // A trace is a piece of information about a branch.  The external 
 // representation of a trace is 9 bytes:
@@ -32,27 +40,45 @@
 //
 // The input file is usually compressed either with gzip or bzip2 and this
 // file contains code to support reading from these formats by piping the
-// output of the decompressors.  However, this file s does another kind of
-// decompression on the traces after they have been decompressed by gzip
-// or bzip2.  If the upper four bits of the first byte read are either
-// 0 or 8 then the byte indicates that the trace has been compressed
-// from the 9 byte representation to a 1 or 2 byte representation.  This
-// compression is faciliated with prediction described below.  The compression
-// achieved is not impressive -- Huffman coding would do much better -- but
-// the purpose is to allow the stream of bytes fed to gzip or bzip2 to be
-// much more redundant and hence more compressible.
+// output of the decompressors.  The input can be any file descriptor, so
+// traces can come from standard input or another program as well as from
+// a file; the compression method is sniffed from the first bytes read.
+// However, this file does another kind of decompression on the traces
+// after they have been decompressed by gzip or bzip2.  If the upper four
+// bits of the first byte read are either 0 or 8 then the byte indicates
+// that the trace has been compressed from the 9 byte representation to a
+// 1 or 2 byte representation.  This compression is faciliated with
+// prediction described below.  The compression achieved is not
+// impressive -- Huffman coding would do much better -- but the purpose is
+// to allow the stream of bytes fed to gzip or bzip2 to be much more
+// redundant and hence more compressible.
+//
+// Either representation may also contain run records: the byte 0x84
+// followed by a four byte little-endian count n means the trace before it
+// comes n more times in a row.  The repeats are neither looked up in nor
+// added to the predictor table or return address stack below, by the
+// writer or the reader.  Tight loops give long runs of one trace, which a
+// branch predictor can then replay at once (see read_run).  Only tracegen
+// -r writes run records; compress/ct doesn't know them.
+
+#define RUN_CODE	0x84
 
 // number of bytes to read at once from the decompressor
 
-#define BUFSIZE	10000
+#define BUFSIZE	(1<<20)
+
+// file descriptor for the trace, or for the pipe from the decompressor
 
-// file pointer for the pipe from the decompressor
+int tracefd = -1;
 
-FILE *tracefp;
+// the decompressor and the process feeding it, if any
 
-// buffer to read bytes into
+static pid_t decompressor_pid = -1, feeder_pid = -1;
 
-unsigned char buf[BUFSIZE];
+// buffer to read bytes into, page aligned so the kernel can copy into it
+// a page at a time
+
+unsigned char buf[BUFSIZE] __attribute__ ((aligned (4096)));
 
 // current position in buffer
 unsigned int bufpos;
@@ -65,6 +91,23 @@ unsigned int bufsize;
 
 bool end_of_file;
 
+// at the end of the decompressed input, make sure the decompressor got to
+// the end of the compressed one.  otherwise the trace is cut short, which
+// must not pass for a whole trace
+
+static void check_decompressor (void) {
+	if (bunzip_failed ()) exit (1);
+	if (decompressor_pid > 0) {
+		int status;
+		waitpid (decompressor_pid, &status, 0);
+		decompressor_pid = -1;
+		if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+			fprintf (stderr, "the trace decompressor failed\n");
+			exit (1);
+		}
+	}
+}
+
 // read a single byte from the trace file
 
 unsigned char read_byte (void) {
@@ -73,15 +116,19 @@ unsigned char read_byte (void) {
 
 	if (bufpos == bufsize) {
 
-		// get a BUFSIZE-sized chunk of bytes from the input
+		// get up to a BUFSIZE-sized chunk of bytes from the input
 
 		bufpos = 0;
-		bufsize = fread (buf, 1, BUFSIZE, tracefp);
+		ssize_t n;
+		do n = read (tracefd, buf, BUFSIZE);
+		while (n < 0 && errno == EINTR);
+		bufsize = n < 0 ? 0 : n;
 
 		// nothing to read?  we must be done.
 
 		if (bufsize == 0) {
 			end_of_file = true;
+			check_decompressor ();
 			return 0;
 		}
 	}
@@ -96,6 +143,16 @@ unsigned char read_byte (void) {
 unsigned int read_uint (void) {
 	unsigned int x0, x1, x2, x3;
 
+	// usually all four bytes are in the buffer and can be loaded at once
+
+	if (bufsize - bufpos >= 4) {
+		memcpy (&x0, buf + bufpos, 4);
+		bufpos += 4;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		x0 = __builtin_bswap32 (x0);
+#endif
+		return x0;
+	}
 	x0 = read_byte ();
 	x1 = read_byte ();
 	x2 = read_byte ();
@@ -113,7 +170,6 @@ struct remember {
 	bool taken;
 	unsigned char code; 
 	unsigned int address, target;
-	unsigned int lru_time;
 
 	// constructor
 
@@ -122,7 +178,6 @@ struct remember {
 		address = 0;
 		target = 0;
 		taken = 0;
-		lru_time = 0;
 	}
 
 	// return true if two remember structs are equivalent.  optionally
@@ -175,58 +230,196 @@ unsigned int pop_ras (void) {
 // because we're squeezing set indices into a 3-bit code so having
 // a fixed set size is OK.  in practice, most branches need only 1 or 2
 // possible predictions, but some traces benefit from higher associativity.
+//
+// to keep the table small, a set packs the addresses and codes of its ways
+// together with their LRU ranks (0 for the most recently used through
+// ASSOC-1 for the least, a nibble per way) into one 64-byte cache line.  the
+// targets, needed only on a hit, live in a separate array.  every remembered
+// trace is taken, so that isn't stored.  the ranks give exactly the same
+// replacement decisions as the timestamps compress/ct uses, which the
+// encoded traces depend on.
 
-remember rtab[N_REMEMBER][ASSOC];
+struct remember_set {
+	unsigned int address[ASSOC];
+	unsigned char code[ASSOC];
+	unsigned int ranks;
+} __attribute__ ((aligned (64)));
 
-// this int keeps time for the LRU algorithm
+// both tables come from the arena (see arena.h) the first time they are
+// reset, so they can go on huge pages
 
-static unsigned int now = 0; 
+remember_set *rtab;
+unsigned int (*rtarget)[ASSOC];
 
-// last trace seen
+// untouched ways are ranked by position, so way 0 goes first
 
-static remember last_one; 
+#define INITIAL_RANKS	0x01234567
+
+// false until the first update.  the timestamp scheme stamps the first
+// update with time 0, the same as every untouched way, so that update
+// mustn't change the ranks
+
+static bool started = false;
+
+// target of the last trace seen
+
+static unsigned int last_target;
+
+// unpack way i of set s into r
+
+static inline void get_remember (remember_set *s, int i, remember & r) {
+	r.address = s->address[i];
+	r.code = s->code[i];
+	r.taken = r.code != 0;
+	r.target = rtarget[s - rtab][i];
+}
 
 // predict a trace
 
-remember *predict_remember (void) {
-	unsigned int index = last_one.target & (N_REMEMBER-1);
-	remember *r = &rtab[index][0];
-	return r;
+remember_set *predict_remember (void) {
+	return &rtab[last_target & (N_REMEMBER-1)];
+}
+
+// find me in a predicted set; return its index or -1 if it is not there
+
+int search_remember (remember & me, remember_set *s, bool ignore_target) {
+	unsigned int *targets = rtarget[s - rtab];
+	for (int i=0; i<ASSOC; i++)
+		if (s->address[i] == me.address
+		 && s->code[i] == me.code
+		 && me.taken
+		 && (ignore_target || targets[i] == me.target)) return i;
+	return -1;
+}
+
+// make way i of set s the most recently used.  every way ranked below it
+// moves down one, all at once: adding 8 to each nibble and subtracting i's
+// rank leaves the top bit of a nibble set exactly when its rank is at least
+// i's, and never borrows across nibbles
+
+static inline void touch_remember (remember_set *s, int i) {
+	unsigned int ranks = s->ranks;
+	unsigned int r = (ranks >> (4*i)) & 15;
+
+	// usually it already is
+
+	if (!r) return;
+	unsigned int ge = ((ranks | 0x88888888) - r * 0x11111111) & 0x88888888;
+	ranks += (~ge & 0x88888888) >> 3;
+	s->ranks = ranks & ~(15 << (4*i));
+}
+
+// return the least recently used way of set s, the one ranked ASSOC-1.
+// a nibble of x is zero only for that way; the usual test for a zero byte,
+// done on nibbles, flags it and possibly some nibbles above it
+
+static inline int lru_remember (remember_set *s) {
+	unsigned int x = s->ranks ^ ((ASSOC-1) * 0x11111111);
+	unsigned int z = (x - 0x11111111) & ~x & 0x88888888;
+	return __builtin_ctz (z) >> 2;
 }
 
 // update the predictor
 
-void update_remember (remember & me, remember *r, bool correct, int index) {
-	if (correct) {
-		r[index].lru_time = now++;
-	} else {
+static inline void update_remember (remember & me, remember_set *s, bool correct, int index) {
+	if (!correct) {
 		// throw out the LRU item and replace it with me
-		int lru = 0;
-		for (int i=1; i<ASSOC; i++)
-			if (r[i].lru_time < r[lru].lru_time) lru = i;
-		r[lru] = me;
-		r[lru].lru_time = now++;
+		index = lru_remember (s);
+		s->address[index] = me.address;
+		s->code[index] = me.code;
+		rtarget[s - rtab][index] = me.target;
 	}
-	last_one = me;
+	if (started) touch_remember (s, index);
+	started = true;
+
+	// the next trace will be looked up in the set this one points to.
+	// if that's a different set, get it on its way to the cache while
+	// the branch predictor runs
+
+	unsigned int next = me.target & (N_REMEMBER-1);
+	if (next != (last_target & (N_REMEMBER-1))) {
+		__builtin_prefetch (&rtab[next]);
+		__builtin_prefetch (&rtarget[next]);
+	}
+	last_target = me.target;
 }
 
-// read a single trace from the file
+// the last trace decoded, and how many more times it comes in the run
+// being read
 
-trace *read_trace (void) {
-	static trace t;
+static unsigned int run_address, run_target;
+static unsigned char run_code;
+static unsigned int run_left;
+
+// forget everything the predictor and return address stack have learned.
+// the encoder and decoder must start from the same state
+
+void reset_remember (void) {
+
+	if (!rtab) {
+		rtab = (remember_set *) arena_alloc (N_REMEMBER * sizeof (remember_set), "decoder sets");
+		rtarget = (unsigned int (*)[ASSOC]) arena_alloc (N_REMEMBER * sizeof (*rtarget), "decoder targets");
+	}
+	memset (rtab, 0, N_REMEMBER * sizeof (remember_set));
+	for (int i=0; i<N_REMEMBER; i++) rtab[i].ranks = INITIAL_RANKS;
+	memset (rtarget, 0, N_REMEMBER * sizeof (*rtarget));
+	started = false;
+	last_target = 0;
+	init_ras ();
+	run_code = 0;
+	run_left = 0;
+}
+
+// the branch flags for the high 4 bits of a code, as set by read_trace
+
+static const unsigned char code_flags[8] = {
+	0, BR_CONDITIONAL, BR_CONDITIONAL, 0, BR_INDIRECT,
+	BR_CALL, BR_CALL | BR_INDIRECT, BR_RETURN
+};
+
+// decode the next trace from the file into its branch address, target and
+// one byte code.  return false at end of file
+
+static inline bool decode_trace (unsigned int & address, unsigned int & target, unsigned char & code) {
 	bool ras_correct, ras_offby2, ras_offby3, correct;
 
-	// read the next byte; it will either be a code, a set index for
-	// a correct prediction, or a prefix for patching a return address 
-	// prediction.
+	// a trace from a trace server is already decoded
 
-	unsigned char c = read_byte ();
-	if (end_of_file) return NULL;
+	if (shm_traces) {
+		if (shm_pos == shm_ready && !wait_shm_trace ()) return false;
+		packed_trace *s = &shm_traces[shm_pos++];
+		address = s->address;
+		target = s->target;
+		code = s->code;
+		return true;
+	}
+
+	// read the next byte, unless the last trace is being repeated; it
+	// will either be a code, a set index for a correct prediction, a
+	// prefix for patching a return address prediction, or the start of
+	// a run record.  the rest of a run is the last trace again
+
+	unsigned char c = RUN_CODE;
+	if (!run_left) {
+		c = read_byte ();
+		if (end_of_file) return false;
+		if (c == RUN_CODE) {
+			run_left = read_uint ();
+			assert (run_code && run_left);
+		}
+	}
+	if (c == RUN_CODE) {
+		run_left--;
+		address = run_address;
+		target = run_target;
+		code = run_code;
+		return true;
+	}
 	remember r;
 
 	// predict the next trace
 
-	remember *p = predict_remember ();
+	remember_set *p = predict_remember ();
 
 	// assume return address prediction is correct
 
@@ -277,7 +470,7 @@ trace *read_trace (void) {
 		// at this point we have the predicted set in p
 		// and the index into the predicted set in c.
 
-		r = p[c];
+		get_remember (p, c, r);
 
 		// if this is a trace for a return...
 
@@ -310,9 +503,8 @@ trace *read_trace (void) {
 
 		// set the rest of the fields from the prediction
 
-		t.bi.address = r.address;
-		t.target = r.target;
-		t.taken = r.taken;
+		address = r.address;
+		target = r.target;
 
 		// update the predictor
 
@@ -330,21 +522,18 @@ trace *read_trace (void) {
 
 		// read the branch address
 
-		t.bi.address = read_uint ();
+		address = read_uint ();
 
 		// read the branch target
 
-		t.target = read_uint ();
-
-		// assume the branch is taken; fix later
-
-		t.taken = true;
+		target = read_uint ();
 
-		// prepare a remember struct for the predictor
+		// prepare a remember struct for the predictor.  every
+		// remembered trace counts as taken; the code says otherwise
 
-		r.address = t.bi.address;
-		r.target = t.target;
-		r.taken = t.taken;
+		r.address = address;
+		r.target = target;
+		r.taken = true;
 		r.code = c;
 
 		// if we have a return...
@@ -362,9 +551,9 @@ trace *read_trace (void) {
 			// regardless of whether the trace is predicted
 			// correctly, so we have to also.
 
-			if (popd != t.target
-			 && popd != t.target - 2
-			 && popd != t.target + 3) init_ras();
+			if (popd != target
+			 && popd != target - 2
+			 && popd != target + 3) init_ras();
 		}
 
 		// update the predictor
@@ -372,90 +561,443 @@ trace *read_trace (void) {
 		update_remember (r, p, false, -1);
 	}
 
-	// get the conditional branch opcode, if any
-
-	t.bi.opcode = c & 15;
-
-	// br_flags gives information about the branch; initially empty
-
-	t.bi.br_flags = 0;
-
-	// get the high 4 bits of the code
+	// calls push their return addresses
 
-	c >>= 4;
-	switch (c) {
+	code = c;
+	switch (c >> 4) {
 	case 1: // taken conditional branch
-		t.bi.br_flags |= BR_CONDITIONAL;
-		break;
 	case 2: // not taken conditional branch
-		t.taken = false;
-		t.bi.br_flags |= BR_CONDITIONAL;
-		break;
 	case 3: // unconditional branch
-		break;
 	case 4: // indirect branch
-		t.bi.br_flags |= BR_INDIRECT;
+	case 7: // return
 		break;
 	case 5: // call
-		t.bi.br_flags |= BR_CALL;
-		push_ras (t.bi.address + 5);
+		push_ras (address + 5);
 		break;
 	case 6: // indirect call
-		t.bi.br_flags |= BR_CALL | BR_INDIRECT;
-		push_ras (t.bi.address + 2);
-		break;
-	case 7: // return
-		t.bi.br_flags |= BR_RETURN;
+		push_ras (address + 2);
 		break;
 	// this should "never" happen
-	default: fprintf (stderr, "%d\n", c); fflush (stderr); assert (0);
+	default: fprintf (stderr, "%d\n", c >> 4); fflush (stderr); assert (0);
 	}
+	run_address = address;
+	run_target = target;
+	run_code = c;
+	return true;
+}
+
+// read a single trace from the file
+
+trace *read_trace (void) {
+	static trace t;
+	unsigned char c;
+
+	if (!decode_trace (t.bi.address, t.target, c)) return NULL;
+
+	// the low 4 bits of the code are the conditional branch opcode, if
+	// any, and the high 4 bits give the kind of branch
+
+	t.bi.opcode = c & 15;
+	t.bi.br_flags = code_flags[(c >> 4) & 7];
+	t.taken = (c >> 4) != 2;
 	return & t;
 }
 
+// read a trace and how many times in a row it comes, at most max, into n.
+// the repeats are taken from a run record without being decoded one by
+// one, so the trace can be replayed n times at once; a trace that isn't in
+// a run comes once
+
+trace *read_run (unsigned int max, unsigned int *n) {
+	trace *t = read_trace ();
+	if (!t) return NULL;
+	unsigned int k = run_left < max - 1 ? run_left : max - 1;
+	run_left -= k;
+	*n = k + 1;
+	return t;
+}
+
+// read up to n traces, at most TRACE_BLOCK, into b.  return how many were
+// read; fewer than n means the end of the file was reached
+
+int read_traces (trace_block *b, int n) {
+	int i;
+
+	if (n > TRACE_BLOCK) n = TRACE_BLOCK;
+	memset (b->taken, 0, sizeof (b->taken));
+	for (i=0; i<n; i++) {
+		unsigned char c;
+		if (!decode_trace (b->address[i], b->target[i], c)) break;
+		b->flags[i] = (code_flags[(c >> 4) & 7] << 4) | (c & 15);
+		b->taken[i/64] |= (unsigned long long int) ((c >> 4) != 2) << (i % 64);
+	}
+	b->n = i;
+	return i;
+}
+
 // open the trace file for reading
 
 #define GZIP_MAGIC     "\037\213"
 #define BZIP2_MAGIC	"BZ"
 
-void init_trace (char *fname) {
-	const char *dc;
-	char s[2] = { 0, 0 };
-	char cmd[1000];
-
-	// figure out the compression method from the magic number
-
-	FILE *f = fopen (fname, "r");
-	if (!f) {
-		perror (fname);
-	}
-	assert (fread (s, 1, 2, f) == 2);
-	fclose (f);
-	if (strncmp (s, GZIP_MAGIC, 2) == 0) 
-		dc = ZCAT;
-	else if (strncmp (s, BZIP2_MAGIC, 2) == 0)
-		dc = BZCAT;
-	else
-		dc = CAT;
-
-	// make a command that will decompress the file to stdout
+// copy everything left in fd to out, the way cat would.  splice moves the
+// data between the descriptors without copying it through user space when
+// one of them is a pipe; otherwise fall back to read and write
+
+static void copy_fd (int fd, int out) {
+	for (;;) {
+		ssize_t n = splice (fd, NULL, out, NULL, BUFSIZE, SPLICE_F_MOVE);
+		if (n == 0) return;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+	}
+	for (;;) {
+		ssize_t n = read (fd, buf, BUFSIZE);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		for (ssize_t m = 0; m < n; ) {
+			ssize_t w = write (out, buf + m, n - m);
+			if (w < 0 && errno == EINTR) continue;
+			if (w < 0) return;
+			m += w;
+		}
+	}
+}
 
-	sprintf (cmd, "%s %s", dc, fname);
+// make a pipe with a big buffer so the decompressor rarely waits for us
 
-	// pipe that stdout to tracefp
+static void make_pipe (int p[2]) {
+	if (pipe (p)) {
+		perror ("pipe");
+		exit (1);
+	}
+	fcntl (p[1], F_SETPIPE_SZ, BUFSIZE);
+}
 
-	tracefp = popen (cmd, "r");
-	if (!tracefp) {
-		perror (fname);
+// start the decompressor command dc reading from fd, whose first n bytes
+// are already in buf, and point tracefd at its output.  the command is run
+// directly rather than through a shell
+
+static void start_decompressor (const char *dc, int fd, unsigned int n) {
+	char cmd[1000], *argv[32];
+	int argc = 0, in[2], out[2];
+
+	// split the command into words
+
+	strncpy (cmd, dc, sizeof (cmd) - 1);
+	cmd[sizeof (cmd) - 1] = 0;
+	for (char *w = strtok (cmd, " "); w && argc < 31; w = strtok (NULL, " "))
+		argv[argc++] = w;
+	argv[argc] = NULL;
+
+	// a regular file can be rewound and handed to the decompressor as is.
+	// anything else needs a feeder process to put back the bytes we've
+	// already read
+
+	in[0] = fd;
+	in[1] = -1;
+	feeder_pid = -1;
+	if (lseek (fd, 0, SEEK_SET) != 0) {
+		make_pipe (in);
+		feeder_pid = fork ();
+		if (feeder_pid == 0) {
+			close (in[0]);
+			for (unsigned int m = 0; m < n; ) {
+				ssize_t w = write (in[1], buf + m, n - m);
+				if (w < 0 && errno == EINTR) continue;
+				if (w < 0) _exit (1);
+				m += w;
+			}
+			copy_fd (fd, in[1]);
+			_exit (0);
+		}
+		if (feeder_pid < 0) {
+			perror ("fork");
+			exit (1);
+		}
+		close (in[1]);
+	}
+	make_pipe (out);
+	decompressor_pid = fork ();
+	if (decompressor_pid == 0) {
+		dup2 (in[0], 0);
+		dup2 (out[1], 1);
+		if (in[0] != 0) close (in[0]);
+		if (fd != in[0] && fd != 0) close (fd);
+		close (out[0]);
+		close (out[1]);
+		execv (argv[0], argv);
+		perror (argv[0]);
+		_exit (1);
+	}
+	if (decompressor_pid < 0) {
+		perror ("fork");
 		exit (1);
 	}
+	close (in[0]);
+	if (fd != in[0]) close (fd);
+	close (out[1]);
+	tracefd = out[0];
+}
+
+// read a trace from the file descriptor fd, which might be a file, a pipe
+// or a socket.  it is closed by end_trace
+
+void init_trace_fd (int fd) {
+
+	// read the first chunk of the input to figure out the compression
+	// method from the magic number
+
+	unsigned int n = 0;
+	while (n < 2) {
+		ssize_t r = read (fd, buf + n, BUFSIZE - n);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) break;
+		n += r;
+	}
+	decompressor_pid = -1;
+	feeder_pid = -1;
 	bufpos = 0;
 	bufsize = 0;
+	if (n >= 2 && memcmp (buf, GZIP_MAGIC, 2) == 0)
+		start_decompressor (ZCAT, fd, n);
+	else if (n >= 2 && memcmp (buf, BZIP2_MAGIC, 2) == 0) {
+		// the parallel decompressor needs the whole input before it
+		// starts, which a file already is.  a pipe or socket streams
+		// through BZCAT instead, so memory doesn't grow with it and
+		// decompression keeps up with the producer
+
+		if (PARALLEL_BZIP2 && lseek (fd, 0, SEEK_CUR) >= 0)
+			tracefd = start_bunzip (fd, buf, n, sysconf (_SC_NPROCESSORS_ONLN));
+		else
+			start_decompressor (BZCAT, fd, n);
+	}
+	else {
+		// not compressed; the bytes we have are the start of the trace
+
+		tracefd = fd;
+		bufsize = n;
+	}
 	end_of_file = false;
+	reset_remember ();
 }
 
-// close the trace file
+// open the named trace file for reading; "-" means standard input and
+// "shm:<name>" the trace being served by traceserve under that name
+
+void init_trace (char *fname) {
+	int fd = 0;
+
+	if (strncmp (fname, SHM_PREFIX, strlen (SHM_PREFIX)) == 0) {
+		char name[256];
+		const char *n = fname + strlen (SHM_PREFIX);
+		snprintf (name, sizeof (name), "%s%s", n[0] == '/' ? "" : "/", n);
+		if (!attach_shm_trace (name)) {
+			fprintf (stderr, "%s: no trace is being served as %s\n", fname, name);
+			exit (1);
+		}
+		return;
+	}
+	if (strcmp (fname, "-") != 0) {
+		fd = open (fname, O_RDONLY);
+		if (fd < 0) {
+			perror (fname);
+			exit (1);
+		}
+	}
+	init_trace_fd (fd);
+}
+
+// close the trace file and reap the decompressor
 
 void end_trace (void) {
-	fclose (tracefp);
+	if (shm_traces) {
+		detach_shm_trace ();
+		return;
+	}
+	close (tracefd);
+	tracefd = -1;
+	end_bunzip ();
+	if (feeder_pid > 0) waitpid (feeder_pid, NULL, 0);
+	if (decompressor_pid > 0) waitpid (decompressor_pid, NULL, 0);
+	feeder_pid = -1;
+	decompressor_pid = -1;
+}
+
+// reconstruct the one byte code for a trace from its branch flags
+
+unsigned char trace_code (trace *t) {
+	unsigned char c = t->bi.opcode & 15;
+
+	if (t->bi.br_flags & BR_CONDITIONAL)
+		c |= t->taken ? 0x10 : 0x20;
+	else if (t->bi.br_flags & BR_RETURN)
+		c |= 0x70;
+	else if (t->bi.br_flags & BR_CALL)
+		c |= (t->bi.br_flags & BR_INDIRECT) ? 0x60 : 0x50;
+	else if (t->bi.br_flags & BR_INDIRECT)
+		c |= 0x40;
+	else
+		c |= 0x30;
+	return c;
+}
+
+// pack a trace for keeping in memory
+
+void pack_trace (trace *t, packed_trace *p) {
+	p->address = t->bi.address;
+	p->target = t->target;
+	p->code = trace_code (t);
+}
+
+// unpack a trace packed by pack_trace
+
+void unpack_trace (packed_trace *p, trace *t) {
+	t->bi.address = p->address;
+	t->target = p->target;
+	t->bi.opcode = p->code & 15;
+	t->bi.br_flags = code_flags[(p->code >> 4) & 7];
+	t->taken = (p->code >> 4) != 2;
+}
+
+// the rest of this file writes traces.  the output is either the plain 9-byte
+// representation or the predicted 1 or 2 byte representation described at
+// the top of this file, which is what compress/ct -c produces.  the encoder
+// shares the predictor table with the decoder, so a program can't read and
+// write traces at the same time.
+
+// file pointer for the output
+
+FILE *outfp;
+
+// true when we are writing the predicted representation
+
+bool out_predicted;
+
+// true when runs of the same trace are written as run records, and the
+// last trace written, if any, and how many times it has come again since.
+// runs shorter than RUN_MIN are written trace by trace, which takes less
+// room
+
+static bool out_runs, out_any;
+static trace out_last;
+static unsigned int out_repeats;
+
+#define RUN_MIN	5
+
+// write a trace in the 9-byte representation
+
+static void write_raw (unsigned char c, unsigned int address, unsigned int target) {
+	unsigned char b[9];
+	b[0] = c;
+	for (int i=0; i<4; i++) {
+		b[1+i] = address >> (8*i);
+		b[5+i] = target >> (8*i);
+	}
+	fwrite (b, 1, 9, outfp);
+}
+
+// start writing traces to f
+
+void init_trace_writer (FILE *f, bool predicted, bool runs) {
+	outfp = f;
+	out_predicted = predicted;
+	out_runs = runs;
+	out_any = false;
+	out_repeats = 0;
+	reset_remember ();
+}
+
+// write a single trace, not as part of a run
+
+static void write_one (trace *t) {
+	unsigned char c = trace_code (t);
+
+	if (!out_predicted) {
+		write_raw (c, t->bi.address, t->target);
+		return;
+	}
+
+	// the decoder remembers every trace as taken; the code says otherwise
+
+	remember r;
+	r.code = c;
+	r.address = t->bi.address;
+	r.target = t->target;
+	r.taken = true;
+	remember_set *p = predict_remember ();
+	bool ras_correct = false, ras_offby2 = false, ras_offby3 = false;
+
+	// for a return, see whether the return address stack gets the target
+	// right, possibly with a small patch
+
+	if (c == 0x70) {
+		unsigned int popd = pop_ras ();
+		ras_correct = popd == t->target;
+		if (!ras_correct) {
+			if (t->target == popd + 2) {
+				ras_correct = true;
+				ras_offby2 = true;
+			} else if (t->target == popd - 3) {
+				ras_correct = true;
+				ras_offby3 = true;
+			}
+		}
+		if (!ras_correct) init_ras ();
+	}
+	int index = search_remember (r, p, ras_correct);
+	bool correct = index != -1;
+	update_remember (r, p, correct, index);
+	if (correct) {
+		if (ras_offby2) putc (0x82, outfp);
+		else if (ras_offby3) putc (0x83, outfp);
+		putc (index + (ras_correct ? ASSOC : 0), outfp);
+	} else
+		write_raw (c, t->bi.address, t->target);
+
+	// calls push their return addresses just like in read_trace
+
+	if ((c >> 4) == 5) push_ras (t->bi.address + 5);
+	else if ((c >> 4) == 6) push_ras (t->bi.address + 2);
+}
+
+// write out the repeats of the last trace
+
+static void end_run (void) {
+	if (out_repeats >= RUN_MIN) {
+		unsigned char b[5];
+		b[0] = RUN_CODE;
+		for (int i=0; i<4; i++) b[1+i] = out_repeats >> (8*i);
+		fwrite (b, 1, 5, outfp);
+	} else
+		for (unsigned int i=0; i<out_repeats; i++) write_one (&out_last);
+	out_repeats = 0;
+}
+
+// write a single trace; with runs, a repeat of the last trace is just
+// counted until the run ends
+
+void write_trace (trace *t) {
+	if (!out_runs) {
+		write_one (t);
+		return;
+	}
+	if (out_any && out_last.bi.address == t->bi.address && out_last.target == t->target
+	 && trace_code (&out_last) == trace_code (t) && out_repeats != ~0U) {
+		out_repeats++;
+		return;
+	}
+	end_run ();
+	write_one (t);
+	out_last = *t;
+	out_any = true;
+}
+
+// finish writing traces
+
+void end_trace_writer (void) {
+	if (out_runs) end_run ();
+	fflush (outfp);
 }
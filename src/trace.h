@@ -1,9 +1,10 @@
 // trace.h
 // This file declares functions and a struct for reading trace files.
 
-// these #define the Unix commands for decompressing gzip, bzip2, and
-// plain files.  If they are somewhere else on your system, change these
-// definitions.
+// these #define the Unix commands for decompressing gzip and bzip2 files.
+// They are run directly, not through a shell, with the compressed trace on
+// standard input.  If they are somewhere else on your system, change these
+// definitions.  Plain files are read directly.
 
 #define ZCAT            "/bin/gzip -dc"
 
@@ -15,7 +16,12 @@
 // this is where it is on Ubuntu Linux
 
 #define BZCAT           "/bin/bzip2 -dc"
-#define CAT             "/bin/cat"
+
+// bzip2 trace files are decompressed in the simulator on as many threads
+// as there are CPUs (see bunzip.h), unless this is 0.  BZCAT is run for
+// them then, and always for bzip2 data from a pipe or socket
+
+#define PARALLEL_BZIP2	1
 
 struct trace {
 	bool	taken;
@@ -23,6 +29,39 @@ struct trace {
 	branch_info bi;
 };
 
+// a trace packed into 12 bytes for keeping whole traces in memory.  code
+// is the one byte code from the trace file format, which gives the opcode,
+// the kind of branch and whether a conditional branch was taken
+
+struct packed_trace {
+	unsigned int address, target;
+	unsigned char code;
+};
+
+// a block of traces decoded at once, as separate arrays so that batch
+// predictors can go through them contiguously.  flags holds a trace's
+// branch flags in its high 4 bits and its opcode in its low 4 bits, and bit
+// i%64 of taken[i/64] is set when trace i was taken
+
+#define TRACE_BLOCK	4096
+
+struct trace_block {
+	unsigned int address[TRACE_BLOCK];
+	unsigned int target[TRACE_BLOCK];
+	unsigned char flags[TRACE_BLOCK];
+	unsigned long long int taken[TRACE_BLOCK/64];
+	int n;		// number of traces in the block
+};
+
 void init_trace (char *);
+void init_trace_fd (int);
 trace *read_trace (void);
+trace *read_run (unsigned int, unsigned int *);
+int read_traces (trace_block *, int);
 void end_trace (void);
+unsigned char trace_code (trace *);
+void pack_trace (trace *, packed_trace *);
+void unpack_trace (packed_trace *, trace *);
+void init_trace_writer (FILE *, bool, bool);
+void write_trace (trace *);
+void end_trace_writer (void);
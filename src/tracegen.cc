@@ -0,0 +1,53 @@
+// tracegen.cc
+// This file contains the main function for tracegen, which writes a
+// synthetic branch stream to standard output.  By default the output is the
+// plain 9-byte trace representation; with -c it is the predicted
+// representation that compress/ct -c produces.  With -r, runs of the same
+// trace are written as run records (see trace.cc).  Any of them can be
+// piped through gzip or bzip2 and read back with predict.
+//
+// tracegen [-c] [-r] n=10000000,branches=4096,depth=8,bias=0.6,uncond=0.1,noise=0.05,seed=1,loops=0,trip=100
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "synth.h"
+
+static void usage (char *prog) {
+	fprintf (stderr, "Usage: %s [-c] [-r] n=<count>,branches=<n>,depth=<bits>,bias=<p>,uncond=<p>,noise=<p>,seed=<s>,loops=<p>,trip=<n>\n", prog);
+	exit (1);
+}
+
+int main (int argc, char *argv[]) {
+	bool predicted = false, runs = false;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "cr")) != -1) {
+		switch (opt) {
+		case 'c': predicted = true; break;
+		case 'r': runs = true; break;
+		default: usage (argv[0]);
+		}
+	}
+	if (optind != argc - 1) usage (argv[0]);
+
+	synth_params sp;
+	if (!parse_synth (argv[optind], sp)) {
+		fprintf (stderr, "%s: bad stream description \"%s\"\n", argv[0], argv[optind]);
+		exit (1);
+	}
+	init_synth (sp);
+	init_trace_writer (stdout, predicted, runs);
+	for (;;) {
+		trace *t = read_synth ();
+		if (!t) break;
+		write_trace (t);
+	}
+	end_trace_writer ();
+	end_synth ();
+	exit (0);
+}
@@ -0,0 +1,95 @@
+// traceserve.cc
+// This file contains the main function for traceserve, which decodes a
+// trace once into POSIX shared memory so that any number of predict runs
+// can read it as shm:<name> without decoding it themselves (see
+// shmtrace.h).  Readers can start as soon as it says it is serving; they
+// wait for the parts that aren't decoded yet.  It keeps serving until it
+// gets SIGINT, SIGTERM or SIGHUP, then removes the trace; readers that are
+// still going keep theirs.
+//
+// traceserve [-c capacity] <name> <trace>
+//
+// -c	the most traces the trace can hold (default 1000000000).  this is
+//	only address space until the traces are written
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "branch.h"
+#include "trace.h"
+#include "shmtrace.h"
+
+// the name the trace is served under, once the segment exists
+
+static char name[256];
+
+// however the server ends, even in the middle of decoding, readers must
+// not find a segment that nobody is writing or will remove
+
+static void unserve (void) {
+	remove_shm_trace (name);
+}
+
+static void usage (char *prog) {
+	fprintf (stderr, "Usage: %s [-c capacity] <name> <trace>\n", prog);
+	exit (1);
+}
+
+int main (int argc, char *argv[]) {
+	unsigned long long int capacity = 1000000000ULL;
+	int opt;
+
+	while ((opt = getopt (argc, argv, "c:")) != -1) {
+		switch (opt) {
+		case 'c': capacity = atoll (optarg); break;
+		default: usage (argv[0]);
+		}
+	}
+	if (optind != argc - 2 || capacity < 1) usage (argv[0]);
+
+	const char *n = argv[optind];
+	snprintf (name, sizeof (name), "%s%s", n[0] == '/' ? "" : "/", n);
+
+	// the signals that stop the server wait until it's ready for them
+
+	sigset_t stop;
+	sigemptyset (&stop);
+	sigaddset (&stop, SIGINT);
+	sigaddset (&stop, SIGTERM);
+	sigaddset (&stop, SIGHUP);
+	sigprocmask (SIG_BLOCK, &stop, NULL);
+
+	// open the trace before there's anything to serve it in, so a bad
+	// one fails without leaving a segment behind
+
+	init_trace (argv[optind+1]);
+	if (!create_shm_trace (name, capacity)) exit (1);
+	atexit (unserve);
+	printf ("serving %s as %s%s\n", argv[optind+1], SHM_PREFIX, n);
+	fflush (stdout);
+
+	unsigned long long int count = 0;
+	for (;;) {
+		trace *t = read_trace ();
+		if (!t) break;
+		append_shm_trace (t);
+		count++;
+
+		// stop early if asked to.  the trace isn't finished, so readers
+		// see the server go away rather than a trace that ends early
+
+		sigset_t pending;
+		if (count % (1<<20) == 0 && !sigpending (&pending)
+			&& (sigismember (&pending, SIGINT) || sigismember (&pending, SIGTERM) || sigismember (&pending, SIGHUP)))
+			exit (1);
+	}
+	end_trace ();
+	finish_shm_trace ();
+
+	int sig;
+	sigwait (&stop, &sig);
+	exit (0);
+}
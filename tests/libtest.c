@@ -0,0 +1,98 @@
+/* libtest.c
+ * A C program that runs a raw 9-byte trace (see trace.cc) through
+ * libpredict and prints the conditional misses and branches, as run_tests
+ * gets them from predict.  The records are kept inside a bigger struct to
+ * check that strided spans are read in place, and the trace is split in
+ * the middle, where the predictor is saved, destroyed and loaded into a
+ * new one, which must make no difference to the result.
+ *
+ * libtest <kind> <raw trace>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libpredict.h"
+
+struct entry {
+	bp_record r;
+	double caller_data;
+};
+
+static const uint8_t code_flags[8] = {
+	0, BP_CONDITIONAL, BP_CONDITIONAL, 0, BP_INDIRECT,
+	BP_CALL, BP_CALL | BP_INDIRECT, BP_RETURN
+};
+
+static uint32_t get_uint (const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+int main (int argc, char *argv[]) {
+	if (argc != 3) {
+		fprintf (stderr, "Usage: %s <kind> <raw trace>\n", argv[0]);
+		return 1;
+	}
+	FILE *f = fopen (argv[2], "rb");
+	if (!f) {
+		perror (argv[2]);
+		return 1;
+	}
+	size_t n = 0, max = 1<<16;
+	struct entry *e = malloc (max * sizeof (struct entry));
+	unsigned char b[9];
+	while (fread (b, 9, 1, f) == 1) {
+		if (n == max) {
+			max *= 2;
+			e = realloc (e, max * sizeof (struct entry));
+		}
+		memset (&e[n], 0, sizeof (e[n]));
+		e[n].r.opcode = b[0] & 15;
+		e[n].r.flags = code_flags[(b[0] >> 4) & 7];
+		e[n].r.taken = (b[0] >> 4) != 2;
+		e[n].r.address = get_uint (b + 1);
+		e[n].r.target = get_uint (b + 5);
+		n++;
+	}
+	fclose (f);
+
+	enum bp_kind kind = (enum bp_kind) atoi (argv[1]);
+	bp_predictor *p = bp_create (kind);
+	if (!p) {
+		fprintf (stderr, "%s: no predictor of kind %d\n", argv[0], (int) kind);
+		return 1;
+	}
+	size_t half = n / 2;
+	size_t misses = bp_predict_update (p, &e[0].r, half, sizeof (struct entry), NULL);
+
+	size_t size = bp_state_size (p);
+	void *state = malloc (size);
+	if (bp_save (p, state, size - 1) != 0 || bp_save (p, state, size) != size) {
+		fprintf (stderr, "%s: bp_save failed\n", argv[0]);
+		return 1;
+	}
+	bp_stats s1;
+	bp_get_stats (p, &s1);
+	bp_destroy (p);
+	p = bp_create (kind);
+	if (bp_load (p, state, size - 1) != -1 || bp_load (p, state, size) != 0) {
+		fprintf (stderr, "%s: bp_load failed\n", argv[0]);
+		return 1;
+	}
+	uint8_t *pred = malloc (n - half + 1);
+	misses += bp_predict_update (p, &e[half].r, n - half, sizeof (struct entry), pred);
+
+	bp_stats s2;
+	bp_get_stats (p, &s2);
+	if (s1.misses + s2.misses != misses) {
+		fprintf (stderr, "%s: stats don't add up\n", argv[0]);
+		return 1;
+	}
+	printf ("%llu %llu\n", (unsigned long long) misses, (unsigned long long) (s1.conditional + s2.conditional));
+	bp_destroy (p);
+	free (pred);
+	free (state);
+	free (e);
+	return 0;
+}